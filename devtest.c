@@ -16,6 +16,7 @@
 const char *version = "\0$VER: devtest " VER " ("__DATE__") \xA9 Chris Hooper";
 
 #include <stdio.h>
+#include <stdarg.h>
 #include <stdlib.h>
 #include <ctype.h>
 #include <string.h>
@@ -23,6 +24,7 @@ const char *version = "\0$VER: devtest " VER " ("__DATE__") \xA9 Chris Hooper";
 #include <exec/types.h>
 #include <devices/trackdisk.h>
 #include <devices/scsidisk.h>
+#include <devices/timer.h>
 #include <libraries/dos.h>
 #include <dos/dosextens.h>
 #include <dos/filehandler.h>
@@ -189,6 +191,8 @@ typedef struct scsi_read_capacity_10_data {
     uint8_t length[4];
 } __packed scsi_read_capacity_10_data_t;
 
+#define SYNCHRONIZE_CACHE_10    0x35
+
 #define SERVICE_ACTION_IN       0x9e
 typedef struct scsi_read_capacity_16_data {
     uint8_t addr[8];
@@ -205,6 +209,8 @@ typedef struct scsi_generic {
 } __packed scsi_generic_t;
 
 #define SCSI_READ_6_COMMAND             0x08
+#define SCSI_READ_10_COMMAND            0x28
+#define SCSI_RW_10_FUA                  0x08  // Force unit access (byte 1)
 #define SCSI_WRITE_6_COMMAND            0x0a
 #define SCSI_WRITE_10_COMMAND           0x2a
 #define SCSI_WRITE_12_COMMAND           0xaa
@@ -278,10 +284,16 @@ typedef struct {
 static int do_read_cmd(struct IOExtTD *tio, uint64_t offset, uint len,
                        void *buf, int nsd);
 static void report_allocmem_fail(uint bufsize, uint memtype);
+static const char *memtype_str(uint32_t mem);
+static void parse_tsize(const char *arg, uint *tsize, int *pos);
+static int parse_offset(const char *arg, uint64_t *offset);
+static int parse_count(const char *arg, uint *value, uint min, uint max);
 
 #define TEST_MAX_CMDS 32
 #define BUF_COUNT     6   // General test buffers
-#define IBUF_COUNT    6   // Integrity test buffers
+#define PIPE_DEPTH    4   // Chunks in flight for pipeline integrity test
+#define IBUF_PIPE     6   // First pipeline integrity test buffer
+#define IBUF_COUNT    (IBUF_PIPE + PIPE_DEPTH * 2)  // Integrity test buffers
 
 BOOL __check_abort_enabled = 0;       // Disable gcc clib2 ^C break handling
 /*
@@ -308,12 +320,28 @@ static uint8_t  *g_tbuf[BUF_COUNT];   // General test buffers for certain tests
 static uint8_t  *g_ibuf[IBUF_COUNT];  // Integrity test buffers
 static uint8_t  *g_align[IBUF_COUNT]; // Integrity test buffers (aligned)
 struct DosEnvec *g_envec;             // Filesystem environment vector
+#define OUTPUT_TEXT 0   // Human-readable results (default)
+#define OUTPUT_JSON 1   // One JSON object per line for each result
+#define OUTPUT_CSV  2   // Comma-separated values with header line
+#define CPU_BUSY_NONE 0xffff  // No CPU utilization measurement available
+
+static uint      g_output = OUTPUT_TEXT; // Result output format (-O)
+static const char *g_result_name;     // Current latency test name
+static void     *g_result_buf;        // Current latency test buffer
+static uint      g_result_xfer;       // Current latency test transfer size
+static uint      g_result_tio;        // Current latency test requests
+static uint      g_cpu_busy = CPU_BUSY_NONE; // CPU busy (0.1%) in last test
 static UBYTE     mem_skip_alloc = 0;  // Skip memory allocate
 static uint32_t  memtype = MEMTYPE_ANY; // Memory type
 static uint64_t  test_cmd_mask[32];
 static args_t    test_cmd_args[TEST_MAX_CMDS];
 static args_t   *cur_test_args = NULL;
 static uint      flag_destructive = 0;
+static uint      flag_lat_hist = 0;   // Record per-request latency histogram
+static uint      flag_cpu = 0;        // Measure CPU utilization in benchmark
+static uint      flag_nocache = 0;    // Benchmark reads from unread areas
+static uint      bench_duration = 0;  // Seconds per measurement (-T)
+static uint      bench_warmup = 1;    // Seconds of discarded warm-up (-T)
 static uint      force_yes = 0;
 static uint      checknum = 0;
 static uint      g_turn_motor_off;    // Drive read/write likely turned motor on
@@ -410,22 +438,39 @@ usage(void)
            "   -c <cmd>[(arg,...)]   test a specific device driver request\n"
            "   -d                    also do destructive operations (write)\n"
 // Undocumented: -dd skips save/restore of data with -i integrity test
+           "   -e <test>[(arg,...)]  run extended benchmark test (-e alone "
+                    "for list)\n"
            "   -g                    report drive geometry\n"
            "   -h                    display help\n"
+           "   -H                    report benchmark latency percentiles\n"
            "   -i <tsize>[,<align>]  integrity test [-d=destructive] "
                     "[-dd=no save]\n"
            "                         [-i=random -ii=address -iii=pattern]\n"
-           "   -k <mode>             integrity test mode: simple or butterfly\n"
+           "   -k <mode>             integrity test mode: simple, butterfly, "
+                    "or pipeline\n"
            "   -l <loops>            run multiple times\n"
            "   -m <addr>             "
                     "use specific memory (Chip Fast Zorro MB Copr -=list)\n"
            "   -mm <addr>            "
                     "use specific address without allocation by OS\n"
+           "   -n                    benchmark reads from uncached areas "
+                    "of device\n"
            "   -o                    test open/close\n"
+           "   -O <fmt>              benchmark output format: json or csv\n"
            "   -p                    probe SCSI bus for devices "
                     "(unit is optional)\n"
+           "   -r <ci%%>[,<max>]      repeat bandwidth test until 95%% "
+                    "CI is within ci%%\n"
+           "   -R <file>[,<pct>]     compare benchmark with baseline "
+                    "(default 10%%)\n"
+           "   -s <offset>           start bandwidth test at device offset "
+                    "(K, M, G)\n"
+           "   -S <file>             save benchmark results as baseline\n"
            "   -t                    test all packet types (basic, TD64, NSD);"
                     " -tt=more\n"
+           "   -T <sec>[,<warmup>]   run each benchmark measurement for "
+                    "sec seconds\n"
+           "   -u                    report CPU utilization during benchmark\n"
            "   -y                    answer all prompts with 'yes'\n",
            version + 7);
 }
@@ -512,24 +557,36 @@ print_test_name(const char *name)
 static void
 print_ltest_name(const char *name)
 {
+    g_result_name = name;
+    g_result_buf  = NULL;
+    g_result_xfer = 0;
+    g_result_tio  = 1;
+    if (g_output != OUTPUT_TEXT)
+        return;
     printf("%-28s", name);
     fflush(stdout);
     fflush(NULL);  // gcc bug? fflush(stdout) doesn't seem to work
 }
 
 static void
-print_fail(int rc)
+fprint_fail(FILE *fp, int rc)
 {
     size_t i;
-    printf("Fail %d", rc);
+    fprintf(fp, "Fail %d", rc);
     for (i = 0; i < ARRAY_SIZE(err_to_str); i++) {
         if (err_to_str[i].errcode == rc) {
-            printf(" %s", err_to_str[i].errstr);
+            fprintf(fp, " %s", err_to_str[i].errstr);
             break;
         }
     }
 }
 
+static void
+print_fail(int rc)
+{
+    fprint_fail(stdout, rc);
+}
+
 static void
 print_fail_nl(int rc)
 {
@@ -540,6 +597,51 @@ print_fail_nl(int rc)
     printf("\n");
 }
 
+/*
+ * msg_fp
+ * ------
+ * Return the stream for messages which are not results: stdout for text
+ * output, or stderr with -O json or csv so the result stream stays
+ * parseable.
+ */
+static FILE *
+msg_fp(void)
+{
+    return ((g_output == OUTPUT_TEXT) ? stdout : stderr);
+}
+
+static void
+print_msg(const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    vfprintf(msg_fp(), fmt, ap);
+    va_end(ap);
+}
+
+static void
+print_msg_fail(int rc)
+{
+    fprint_fail(msg_fp(), rc);
+}
+
+/*
+ * print_io_fail
+ * -------------
+ * Reports a failed transfer at the given device offset, on the message
+ * stream.
+ */
+static void
+print_io_fail(const char *what, int rc, uint32_t offset)
+{
+    FILE *fp = msg_fp();
+
+    fprintf(fp, "%s ", what);
+    fprint_fail(fp, rc);
+    fprintf(fp, " at 0x%x\n", offset);
+}
+
 static char *
 llu_to_str(uint64_t value)
 {
@@ -1515,7 +1617,7 @@ print_time(void)
 static void
 print_perf_type(int is_write, uint xfer_size)
 {
-    if (g_verbose == 0) {
+    if ((g_verbose == 0) && (g_output == OUTPUT_TEXT)) {
         printf("%s ", is_write ? "write" : "read ");
         if (xfer_size > 1024)
             printf("%3u KB ", xfer_size / 1024);
@@ -1527,24 +1629,554 @@ print_perf_type(int is_write, uint xfer_size)
     }
 }
 
-static uint32_t
+static uint64_t
 diff_e_clock(struct EClockVal *ev1, struct EClockVal *ev2)
 {
     return (*((uint64_t *) ev2) - *((uint64_t *) ev1));
 }
 
+/*
+ * Per-request latency histogram
+ *
+ * Samples are EClock ticks. Values below LAT_HIST_SUB are counted
+ * exactly. Larger values are bucketed by power of two, with each
+ * power of two divided into LAT_HIST_SUB linear steps (about 12%
+ * resolution). This needs only shifts and compares, so it is cheap
+ * enough to record every request, even on a 68000.
+ */
+#define LAT_HIST_SUB     8
+#define LAT_HIST_BUCKETS (LAT_HIST_SUB * 30)
+
+typedef struct {
+    uint32_t count;
+    uint32_t min;
+    uint32_t max;
+    uint64_t sum;
+    uint32_t bucket[LAT_HIST_BUCKETS];
+} lat_hist_t;
+
+static lat_hist_t g_lat_hist;
+
+static void
+lat_hist_clear(lat_hist_t *hist)
+{
+    memset(hist, 0, sizeof (*hist));
+    hist->min = 0xffffffff;
+}
+
+static void
+lat_hist_add(lat_hist_t *hist, uint32_t ticks)
+{
+    uint32_t value = ticks;
+    uint     shift = 0;
+
+    if (ticks < hist->min)
+        hist->min = ticks;
+    if (ticks > hist->max)
+        hist->max = ticks;
+    hist->count++;
+    hist->sum += ticks;
+
+    if (value < LAT_HIST_SUB) {
+        hist->bucket[value]++;
+        return;
+    }
+    while (value >= LAT_HIST_SUB * 2) {
+        value >>= 1;
+        shift++;
+    }
+    hist->bucket[LAT_HIST_SUB * (shift + 1) + value - LAT_HIST_SUB]++;
+}
+
+/*
+ * lat_hist_value
+ * --------------
+ * Return the tick value at the specified percentile of recorded samples,
+ * where permille is in tenths of a percent (500 = 50%, 999 = 99.9%).
+ * The value returned is the midpoint of the bucket containing the sample.
+ */
+static uint32_t
+lat_hist_value(lat_hist_t *hist, uint permille)
+{
+    uint32_t target;
+    uint32_t sum = 0;
+    uint32_t value;
+    uint     shift;
+    uint     pos;
+
+    if (hist->count == 0)
+        return (0);
+
+    target = (uint64_t) hist->count * permille / 1000;
+    for (pos = 0; pos < LAT_HIST_BUCKETS; pos++) {
+        sum += hist->bucket[pos];
+        if (sum > target)
+            break;
+    }
+    if (pos < LAT_HIST_SUB) {
+        value = pos;
+    } else {
+        shift = pos / LAT_HIST_SUB - 1;
+        value = ((pos % LAT_HIST_SUB + LAT_HIST_SUB) << shift) +
+                ((1 << shift) >> 1);
+    }
+    if (value < hist->min)
+        value = hist->min;
+    if (value > hist->max)
+        value = hist->max;
+    return (value);
+}
+
+static void
+print_lat_hist(lat_hist_t *hist)
+{
+    static const struct {
+        const char *name;
+        uint        permille;
+    } pcts[] = {
+        { "p50", 500 }, { "p90", 900 }, { "p99", 990 }, { "p99.9", 999 },
+    };
+    uint pos;
+    uint tusec;
+
+    if ((hist->count == 0) || (g_output != OUTPUT_TEXT))
+        return;
+
+    tusec = (uint64_t) hist->min * 1000000 / g_e_freq;
+    printf("    min %u.%03u", tusec / 1000, tusec % 1000);
+    for (pos = 0; pos < ARRAY_SIZE(pcts); pos++) {
+        tusec = (uint64_t) lat_hist_value(hist, pcts[pos].permille) *
+                1000000 / g_e_freq;
+        printf(" %s %u.%03u", pcts[pos].name, tusec / 1000, tusec % 1000);
+    }
+    tusec = (uint64_t) hist->max * 1000000 / g_e_freq;
+    printf(" max %u.%03u ms\n", tusec / 1000, tusec % 1000);
+}
+
+/*
+ * eclock_timer_open
+ * -----------------
+ * Open a timer.device UNIT_WAITECLOCK request which replies to the
+ * specified port. A test can then sleep until either the timer or one
+ * of its own I/O requests on that port completes.
+ */
+static struct timerequest *
+eclock_timer_open(struct MsgPort *mp)
+{
+    struct timerequest *treq;
+
+    treq = (struct timerequest *) CreateExtIO(mp, sizeof (*treq));
+    if (treq == NULL) {
+        printf("Failed to create timer request\n");
+        return (NULL);
+    }
+    if (OpenDevice(TIMERNAME, UNIT_WAITECLOCK,
+                   (struct IORequest *) treq, 0) != 0) {
+        printf("Failed to open %s\n", TIMERNAME);
+        DeleteExtIO((struct IORequest *) treq);
+        return (NULL);
+    }
+    return (treq);
+}
+
+/*
+ * eclock_timer_close
+ * ------------------
+ * Abort the timer request if it is still outstanding, then close it.
+ */
+static void
+eclock_timer_close(struct timerequest *treq, uint busy)
+{
+    if (busy) {
+        AbortIO((struct IORequest *) treq);
+        WaitIO((struct IORequest *) treq);
+    }
+    CloseDevice((struct IORequest *) treq);
+    DeleteExtIO((struct IORequest *) treq);
+}
+
+/*
+ * eclock_timer_check
+ * ------------------
+ * Reap the timer request if it has completed, so that its reply does
+ * not keep waking WaitPort() on the shared port.
+ */
+static void
+eclock_timer_check(struct timerequest *treq, uint *busy)
+{
+    if (*busy && (CheckIO((struct IORequest *) treq) != NULL)) {
+        WaitIO((struct IORequest *) treq);
+        *busy = 0;
+    }
+}
+
+/*
+ * eclock_timer_wait
+ * -----------------
+ * Sleep until EClock time stime + ticks, or until some other request
+ * replies to the timer's port, whichever comes first. *busy tracks
+ * whether the timer request is outstanding between calls; a timer
+ * which is already running is not restarted.
+ */
+static void
+eclock_timer_wait(struct timerequest *treq, uint *busy,
+                  struct EClockVal *stime, uint64_t ticks)
+{
+    uint64_t due = *((uint64_t *) stime) + ticks;
+
+    if (*busy == 0) {
+        treq->tr_node.io_Command = TR_ADDREQUEST;
+        treq->tr_time.tv_secs    = (uint32_t) (due >> 32);
+        treq->tr_time.tv_micro   = (uint32_t) due;
+        SendIO((struct IORequest *) treq);
+        *busy = 1;
+    }
+    WaitPort(treq->tr_node.io_Message.mn_ReplyPort);
+    eclock_timer_check(treq, busy);
+}
+
+#define TIMED_RUN     0  // Keep going
+#define TIMED_RESTART 1  // Warm-up just ended; reset counters
+#define TIMED_DONE    2  // Measurement time complete (or ^C)
+
+/*
+ * timed_check
+ * -----------
+ * Check progress of a time-bounded measurement (-T) when a request
+ * completes at EClock time now. While *warming is set, results are
+ * discarded. At the end of the warm-up interval, the start time and
+ * latency histogram are reset, and TIMED_RESTART tells the caller to
+ * reset its own counters. TIMED_DONE is returned once bench_duration
+ * seconds have been measured or the user presses ^C.
+ */
+static int
+timed_check(uint *warming, struct EClockVal *stime, struct EClockVal *now)
+{
+    uint64_t elapsed = diff_e_clock(stime, now);
+
+    if (is_user_abort())
+        return (TIMED_DONE);
+    if (*warming) {
+        if (elapsed < (uint64_t) bench_warmup * g_e_freq)
+            return (TIMED_RUN);
+        *warming = 0;
+        *stime = *now;
+        lat_hist_clear(&g_lat_hist);
+        return (TIMED_RESTART);
+    }
+    if (elapsed >= (uint64_t) bench_duration * g_e_freq)
+        return (TIMED_DONE);
+    return (TIMED_RUN);
+}
+
+static uint
+calc_kb_per_sec(uint64_t bytes, uint64_t ticks)
+{
+    if (ticks == 0)
+        ticks = 1;
+    return ((bytes / 1000) * g_e_freq / ticks);
+}
+
+static uint
+ticks_to_usec(uint32_t ticks)
+{
+    return ((uint64_t) ticks * 1000000 / g_e_freq);
+}
+
+/*
+ * tio_wait
+ * --------
+ * Wait for a request to complete and return its error code, from
+ * WaitIO() or, if that reports success, from io_Error.
+ */
+static int
+tio_wait(struct IOExtTD *tio)
+{
+    int failcode = WaitIO((struct IORequest *) tio);
+
+    if (failcode == 0)
+        failcode = tio->iotd_Req.io_Error;
+    return (failcode);
+}
+
+/*
+ * dev_range
+ * ---------
+ * Return the device byte range to test: the bounds of the partition
+ * under test, or the whole device if no partition was given.
+ */
+static void
+dev_range(uint64_t *start, uint64_t *end)
+{
+    *start = g_devstart;
+    *end   = (g_devend != 0) ? g_devend : g_devsize;
+}
+
+/*
+ * print_result
+ * ------------
+ * Emit one measurement as a JSON or CSV record. The latency fields are
+ * in microseconds. If avg_us is 0, the average is taken from the latency
+ * histogram. Percentiles are only reported when the latency histogram
+ * was recorded (-H); otherwise those fields are empty.
+ */
+static void
+print_result(const char *name, uint64_t offset, uint xfer_size, uint num_tio,
+             void *buf, uint64_t ticks, uint64_t bytes, uint count,
+             uint avg_us)
+{
+    static const char * const fields[] = {
+        "min_us", "p50_us", "p90_us", "p99_us", "p999_us", "max_us"
+    };
+    static const uint permille[] = { 0, 500, 900, 990, 999, 1000 };
+    static uint header_done = 0;
+    lat_hist_t *hist = &g_lat_hist;
+    uint pos;
+
+    if ((avg_us == 0) && (hist->count != 0))
+        avg_us = ticks_to_usec(hist->sum / hist->count);
+
+    if (g_output == OUTPUT_CSV) {
+        if (header_done++ == 0) {
+            printf("test,device,unit,memtype,buffer,xfer_size,num_tio,"
+                   "offset,ticks,bytes,count,kb_per_sec,avg_us");
+            for (pos = 0; pos < ARRAY_SIZE(fields); pos++)
+                printf(",%s", fields[pos]);
+            if (flag_cpu)
+                printf(",cpu_pct");
+            printf("\n");
+        }
+        printf("%s,%s,%u,%s,0x%08x,%u,%u,", name, g_devname, g_unitno,
+               (buf == NULL) ? "" : memtype_str((uint32_t) buf),
+               U32(buf), xfer_size, num_tio);
+        printf("%s,", llu_to_str(offset));
+        printf("%s,", llu_to_str(ticks));
+        printf("%s,%u,%u,", llu_to_str(bytes), count,
+               calc_kb_per_sec(bytes, ticks));
+        if (avg_us != 0)
+            printf("%u", avg_us);
+        for (pos = 0; pos < ARRAY_SIZE(fields); pos++) {
+            if (hist->count == 0)
+                printf(",");
+            else
+                printf(",%u", ticks_to_usec((pos == 0) ? hist->min :
+                                            lat_hist_value(hist,
+                                                           permille[pos])));
+        }
+        if (flag_cpu && (g_cpu_busy != CPU_BUSY_NONE))
+            printf(",%u.%u", g_cpu_busy / 10, g_cpu_busy % 10);
+        else if (flag_cpu)
+            printf(",");
+        printf("\n");
+    } else {
+        printf("{\"test\":\"%s\",\"device\":\"%s\",\"unit\":%u,"
+               "\"memtype\":\"%s\",\"buffer\":%u,\"xfer_size\":%u,"
+               "\"num_tio\":%u,", name, g_devname, g_unitno,
+               (buf == NULL) ? "" : memtype_str((uint32_t) buf),
+               U32(buf), xfer_size, num_tio);
+        printf("\"offset\":%s,", llu_to_str(offset));
+        printf("\"ticks\":%s,", llu_to_str(ticks));
+        printf("\"bytes\":%s,\"count\":%u,\"kb_per_sec\":%u",
+               llu_to_str(bytes), count, calc_kb_per_sec(bytes, ticks));
+        if (avg_us != 0)
+            printf(",\"avg_us\":%u", avg_us);
+        if (hist->count != 0) {
+            for (pos = 0; pos < ARRAY_SIZE(fields); pos++)
+                printf(",\"%s\":%u", fields[pos],
+                       ticks_to_usec((pos == 0) ? hist->min :
+                                     lat_hist_value(hist, permille[pos])));
+        }
+        if (flag_cpu && (g_cpu_busy != CPU_BUSY_NONE))
+            printf(",\"cpu_pct\":%u.%u", g_cpu_busy / 10, g_cpu_busy % 10);
+        printf("}\n");
+    }
+    g_cpu_busy = CPU_BUSY_NONE;
+    fflush(stdout);
+}
+
+/*
+ * Benchmark results, kept so they may be saved as a baseline (-S) or
+ * compared against a previously saved baseline (-R). Bandwidth results
+ * are KB/sec, where higher is better. Latency results are microseconds,
+ * where lower is better.
+ */
+#define RESULT_MAX         64
+#define RESULT_LAT_SLACK   5   // Latency change (usec) always ignored
+#define RESULT_TOLERANCE   10  // Default regression tolerance (percent)
+
+typedef struct {
+    const char *name;
+    uint        xfer_size;
+    uint        value;
+    uint        is_rate;
+} result_t;
+
+static result_t    g_results[RESULT_MAX];
+static uint        g_result_count = 0;
+static const char *baseline_save_file = NULL;
+static const char *baseline_cmp_file = NULL;
+static uint        baseline_tolerance = RESULT_TOLERANCE;
+
+static void
+result_save(const char *name, uint xfer_size, uint value, uint is_rate)
+{
+    uint pos;
+
+    for (pos = 0; pos < g_result_count; pos++)
+        if ((g_results[pos].xfer_size == xfer_size) &&
+            (strcmp(g_results[pos].name, name) == 0))
+            break;
+    if (pos == g_result_count) {
+        if (g_result_count >= RESULT_MAX)
+            return;
+        g_result_count++;
+    }
+    g_results[pos].name      = name;
+    g_results[pos].xfer_size = xfer_size;
+    g_results[pos].value     = value;
+    g_results[pos].is_rate   = is_rate;
+}
+
+static uint
+result_find(const char *name, uint xfer_size)
+{
+    uint pos;
+
+    for (pos = 0; pos < g_result_count; pos++)
+        if ((g_results[pos].xfer_size == xfer_size) &&
+            (strcmp(g_results[pos].name, name) == 0))
+            return (g_results[pos].value);
+    return (0);
+}
+
+static int
+baseline_save(const char *filename)
+{
+    FILE *fp;
+    uint  pos;
+
+    fp = fopen(filename, "w");
+    if (fp == NULL) {
+        printf("Unable to create baseline file %s\n", filename);
+        return (1);
+    }
+    fprintf(fp, "# devtest baseline %s %u\n", g_devname, g_unitno);
+    for (pos = 0; pos < g_result_count; pos++) {
+        fprintf(fp, "%u %s %u %s\n", g_results[pos].value,
+                g_results[pos].is_rate ? "KB/sec" : "usec",
+                g_results[pos].xfer_size, g_results[pos].name);
+    }
+    fclose(fp);
+    printf("Saved %u results to %s\n", g_result_count, filename);
+    return (0);
+}
+
+/*
+ * baseline_compare
+ * ----------------
+ * Compare results of this run against a saved baseline file. A result
+ * is a regression if it is worse than the baseline value by more than
+ * the tolerance percentage, or if it was not measured in this run.
+ * Returns the number of regressions found, or -1 if the baseline file
+ * could not be read.
+ */
+static int
+baseline_compare(const char *filename, uint tolerance)
+{
+    FILE *fp;
+    char  line[80];
+    char  units[16];
+    char  label[40];
+    char *name;
+    char *ptr;
+    uint  value;
+    uint  xfer_size;
+    uint  pos;
+    int   change;
+    int   worse;
+    int   regressions = 0;
+    int   len;
+
+    fp = fopen(filename, "r");
+    if (fp == NULL) {
+        printf("Unable to open baseline file %s\n", filename);
+        return (-1);
+    }
+    printf("Compare with baseline %s (tolerance %u%%)\n",
+           filename, tolerance);
+    while (fgets(line, sizeof (line), fp) != NULL) {
+        if ((line[0] == '#') ||
+            (sscanf(line, "%u %15s %u %n", &value, units, &xfer_size,
+                    &len) != 3)) {
+            continue;
+        }
+        name = line + len;
+        if ((ptr = strchr(name, '\n')) != NULL)
+            *ptr = '\0';
+
+        for (pos = 0; pos < g_result_count; pos++)
+            if ((g_results[pos].xfer_size == xfer_size) &&
+                (strcmp(g_results[pos].name, name) == 0))
+                break;
+        if (pos == g_result_count) {
+            /* Not measured in this run: the test may have failed */
+            if (strcmp(units, "KB/sec") == 0)
+                sprintf(label, "%.27s %u KB", name, xfer_size / 1024);
+            else
+                sprintf(label, "%.39s", name);
+            printf("  %-28s %8u -> %8s %-6s       REGRESSION\n", label,
+                   value, "-", units);
+            regressions++;
+            continue;
+        }
+
+        change = (int) (((int64_t) g_results[pos].value - value) * 100 /
+                        ((value != 0) ? value : 1));
+        if (g_results[pos].is_rate) {
+            sprintf(label, "%.27s %u KB", name, xfer_size / 1024);
+            worse = (change < -(int) tolerance);
+        } else {
+            sprintf(label, "%.39s", name);
+            worse = (change > (int) tolerance) &&
+                    (g_results[pos].value > value + RESULT_LAT_SLACK);
+        }
+        printf("  %-28s %8u -> %8u %-6s %+4d%%%s\n", label, value,
+               g_results[pos].value, units, change,
+               worse ? " REGRESSION" : "");
+        if (worse)
+            regressions++;
+    }
+    fclose(fp);
+    printf("%d regression%s\n", regressions, (regressions == 1) ? "" : "s");
+    return (regressions);
+}
+
 static void
-print_latency(uint ttime, uint iters, char endch)
+print_latency(uint64_t ttime, uint iters, char endch)
 {
     uint tusec;
     uint tmsec;
     if (iters == 0)
         iters = 1;
-    tusec = (uint64_t) ttime * 1000000 / g_e_freq / iters;
+    tusec = ttime * 1000000 / g_e_freq / iters;
+
+    if (g_result_name != NULL) {
+        /* Result name is consumed by this report */
+        result_save(g_result_name, g_result_xfer, tusec, 0);
+        if (g_output != OUTPUT_TEXT) {
+            print_result(g_result_name, 0, g_result_xfer, g_result_tio,
+                         g_result_buf, ttime,
+                         (uint64_t) g_result_xfer * iters, iters, tusec);
+            g_result_name = NULL;
+            lat_hist_clear(&g_lat_hist);  // Not for the next test's record
+            return;
+        }
+        g_result_name = NULL;
+    }
     tmsec = tusec / 1000;
     tusec %= 1000;
 
-    printf("%u.%03u ms%c", tmsec, (tusec + 5) / 10, endch);
+    printf("%u.%03u ms%c", tmsec, tusec, endch);
 }
 
 static int
@@ -1588,8 +2220,8 @@ latency_getgeometry(struct IOExtTD **tio, int max_iter)
         failcode = DoIO((struct IORequest *) tio[iter]);
         if (failcode != 0) {
             if (++rc < 10) {
-                printf("  ");
-                print_fail(failcode);
+                print_msg("  ");
+                print_msg_fail(failcode);
             }
         }
 
@@ -1610,7 +2242,7 @@ latency_getgeometry(struct IOExtTD **tio, int max_iter)
     print_latency(ttime, iter, '\n');
 
     if (is_user_abort()) {
-        printf("^C abort\n");
+        print_msg("^C abort\n");
         rc++;
         goto finish_fail;
     }
@@ -1635,11 +2267,11 @@ latency_getgeometry(struct IOExtTD **tio, int max_iter)
         failcode = WaitIO((struct IORequest *) tio[iter]);
         if (failcode != 0) {
             if (++rc < 5) {
-                printf(" ");
-                print_fail(failcode);
-                printf(" ");
+                print_msg(" ");
+                print_msg_fail(failcode);
+                print_msg(" ");
             } else if (rc == 6) {
-                printf(" ... ");
+                print_msg(" ... ");
             }
         }
     }
@@ -1657,6 +2289,33 @@ finish_fail:
     return (rc);
 }
 
+/*
+ * latency_sample
+ * --------------
+ * Called after each request of a sequential latency test completes.
+ * Records the request latency with -H, and with -T tracks the warm-up
+ * and measurement time. TIMED_RESTART tells the caller that warm-up
+ * just ended, so the requests counted so far should be discarded.
+ */
+static int
+latency_sample(uint *warming, struct EClockVal *stime,
+               struct EClockVal *ltime)
+{
+    struct EClockVal etime;
+    int state = TIMED_RUN;
+
+    if (!flag_lat_hist && (bench_duration == 0))
+        return (TIMED_RUN);
+
+    ReadEClock(&etime);
+    if (flag_lat_hist)
+        lat_hist_add(&g_lat_hist, diff_e_clock(ltime, &etime));
+    *ltime = etime;
+    if (bench_duration != 0)
+        state = timed_check(warming, stime, &etime);
+    return (state);
+}
+
 #define BUTTERFLY_MODE_AVG   0  // Average seek time across device
 #define BUTTERFLY_MODE_FAR   1  // Weight toward end of media
 #define BUTTERFLY_MODE_CONST 2  // Constant travel half of device
@@ -1672,21 +2331,92 @@ finish_fail:
  *        *-->           *--------->            *------->
  *          <*            <--------*               <----*
  */
+typedef struct {
+    uint64_t start;  // First byte of pattern area
+    uint64_t end;    // End of pattern area
+    uint64_t step;   // Distance each pass moves inward (or forward)
+    uint64_t half;   // Travel distance for CONST
+    uint     count;  // Number of positions before the pattern repeats
+    int      mode;   // BUTTERFLY_MODE_*
+} butterfly_t;
+
+/*
+ * butterfly_init
+ * --------------
+ * Set up a butterfly pattern of count sector positions between start
+ * and end. For small areas, the count may be reduced.
+ */
+static void
+butterfly_init(butterfly_t *bf, int mode, uint count, uint64_t start,
+               uint64_t end)
+{
+    bf->mode  = mode;
+    bf->start = start;
+    bf->end   = end;
+    bf->count = count;
+    bf->step  = (end - start) / count;
+    if (mode == BUTTERFLY_MODE_FAR)
+        bf->step /= 4;
+
+    if (bf->step < g_sector_size) {
+        bf->step = g_sector_size;
+        bf->count /= 4;
+        if (bf->count == 0)
+            bf->count = 1;
+    }
+    bf->step -= bf->step % g_sector_size;
+    bf->half = (end - start) / 2;
+    bf->half -= bf->half % g_sector_size;
+}
+
+/*
+ * butterfly_pos
+ * -------------
+ * Return the device offset of the specified position in the pattern.
+ */
+static uint64_t
+butterfly_pos(butterfly_t *bf, uint iter)
+{
+    uint     seq = iter % bf->count;
+    uint64_t pos;
+
+    switch (bf->mode) {
+        case BUTTERFLY_MODE_AVG:
+        case BUTTERFLY_MODE_FAR:
+            if ((seq & 1) == 0)
+                pos = bf->start + bf->step * (seq / 2);     // left --> right
+            else
+                pos = bf->end - g_sector_size - bf->step * (seq / 2);
+            break;                                          // left <-- right
+        default:
+        case BUTTERFLY_MODE_CONST:
+            pos = bf->start + bf->step * (seq / 2);         // left --> right
+            if (seq & 1)
+                pos += bf->half;                            // left <-- right
+            break;
+    }
+    return (pos);
+}
+
 static int
 latency_butterfly(UWORD iocmd, uint8_t *buf, int num_iter,
                   struct IOExtTD **tio, int mode)
 {
     int iter;
+    int state;
     int rc = 0;
     int failcode = 0;
-    unsigned int step;
+    uint warming = (bench_warmup != 0);
+    uint measured = 0;
     struct EClockVal stime;
     struct EClockVal etime;
-    uint64_t start = g_devstart;
-    uint64_t end   = g_devend;
-    uint64_t pos   = start;
-    if (end == 0)
-        end = g_devsize;
+    struct EClockVal ltime;
+    uint64_t start;
+    uint64_t end;
+    uint64_t pos;
+    butterfly_t bf;
+
+    dev_range(&start, &end);
 
     if (g_sector_size == 0)
         g_sector_size = 512;
@@ -1704,60 +2434,49 @@ latency_butterfly(UWORD iocmd, uint8_t *buf, int num_iter,
             return (1);
         }
     }
-    step = (end - start) / num_iter;
-    if (mode == BUTTERFLY_MODE_FAR)
-        step /= 4;
-
-    if (step < g_sector_size) {
-        step = g_sector_size;
-        num_iter /= 4;
-    }
+    butterfly_init(&bf, mode, num_iter, start, end);
+    num_iter = bf.count;
 
-    for (iter = 0; iter < num_iter; iter++) {
-        tio[0]->iotd_Req.io_Command = iocmd;
-        tio[0]->iotd_Req.io_Actual  = pos >> 32;
-        tio[0]->iotd_Req.io_Offset  = (uint32_t) pos;
-        tio[0]->iotd_Req.io_Length  = g_sector_size;
-        tio[0]->iotd_Req.io_Data    = buf;
-        tio[0]->iotd_Req.io_Flags   = 0;
-        tio[0]->iotd_Req.io_Error   = 0xa5;
-        switch (mode) {
-            case BUTTERFLY_MODE_AVG:
-            case BUTTERFLY_MODE_FAR:
-                if ((iter & 1) == 0)
-                    pos = step * iter / 2;                  // left --> right
-                else
-                    pos = (end - start) - step * iter / 2;  // left <-- right
-                break;
-            case BUTTERFLY_MODE_CONST:
-                if ((iter & 1) == 0)
-                    pos += (end - start) / 2;               // left --> right
-                else
-                    pos -= ((end - start) / 2 - step);      // left <-- right
-                break;
-        }
-    }
+    tio[0]->iotd_Req.io_Command = iocmd;
+    tio[0]->iotd_Req.io_Length  = g_sector_size;
+    tio[0]->iotd_Req.io_Data    = buf;
+    tio[0]->iotd_Req.io_Flags   = 0;
 
+    g_result_buf  = buf;
+    g_result_xfer = g_sector_size;
+    lat_hist_clear(&g_lat_hist);
     ReadEClock(&stime);
+    ltime = stime;
     /*
      * DoIO always tries IOF_QUICK, but will always wait for the I/O
      * to complete. This is regardless of whether the driver can do
      * quick I/O or not.
      */
-    for (iter = 0; iter < num_iter; iter++) {
+    for (iter = 0; (iter < num_iter) || (bench_duration != 0); iter++) {
+        pos = butterfly_pos(&bf, iter);
+        tio[0]->iotd_Req.io_Actual  = pos >> 32;
+        tio[0]->iotd_Req.io_Offset  = (uint32_t) pos;
+        tio[0]->iotd_Req.io_Error   = 0xa5;
         failcode = DoIO((struct IORequest *) tio[0]);
         if ((failcode != 0) && (iocmd != CMD_INVALID)) {
             rc++;
             break;
         }
+        state = latency_sample(&warming, &stime, &ltime);
+        measured = (state == TIMED_RESTART) ? 0 : measured + 1;
+        if (state == TIMED_DONE)
+            break;
     }
     ReadEClock(&etime);
-    print_latency(diff_e_clock(&stime, &etime), iter, ' ');
+    print_latency(diff_e_clock(&stime, &etime), measured,
+                  (rc != 0) ? ' ' : '\n');
     if (rc != 0)  {
-        printf(" ");
-        print_fail(failcode);
+        print_msg(" ");
+        print_msg_fail(failcode);
+        print_msg("\n");
     }
-    printf("\n");
+    if (flag_lat_hist)
+        print_lat_hist(&g_lat_hist);
     return (rc);
 }
 
@@ -1765,11 +2484,15 @@ static int
 latency_cmd_seq(UWORD iocmd, uint8_t *buf, int num_iter, struct IOExtTD **tio)
 {
     int iter;
+    int state;
     int rc = 0;
     int failcode = 0;
     UBYTE flags = IOF_QUICK;
+    uint warming = (bench_warmup != 0);
+    uint measured = 0;
     struct EClockVal stime;
     struct EClockVal etime;
+    struct EClockVal ltime;
 
     if (iocmd & CMD_FLAG_NOT_QUICK) {
         iocmd &= ~CMD_FLAG_NOT_QUICK;
@@ -1786,19 +2509,28 @@ latency_cmd_seq(UWORD iocmd, uint8_t *buf, int num_iter, struct IOExtTD **tio)
         tio[0]->iotd_Req.io_Error   = 0xa5;
     }
 
+    g_result_buf = buf;
+    if ((iocmd == CMD_READ) || (iocmd == CMD_WRITE))
+        g_result_xfer = BUFSIZE;
+    lat_hist_clear(&g_lat_hist);
     ReadEClock(&stime);
+    ltime = stime;
     if (flags == 0) {
         /*
          * SendIO sets up asynch I/O, where the reply is always by message.
          * The driver should not attempt quick I/O.
          */
-        for (iter = 0; iter < num_iter; iter++) {
+        for (iter = 0; (iter < num_iter) || (bench_duration != 0); iter++) {
             SendIO((struct IORequest *) tio[0]);
             failcode = WaitIO((struct IORequest *) tio[0]);
             if ((failcode != 0) && (iocmd != CMD_INVALID)) {
                 rc++;
                 break;
             }
+            state = latency_sample(&warming, &stime, &ltime);
+            measured = (state == TIMED_RESTART) ? 0 : measured + 1;
+            if (state == TIMED_DONE)
+                break;
         }
     } else {
         /*
@@ -1806,22 +2538,29 @@ latency_cmd_seq(UWORD iocmd, uint8_t *buf, int num_iter, struct IOExtTD **tio)
          * to complete. This is regardless of whether the driver can do
          * quick I/O or not.
          */
-        for (iter = 0; iter < num_iter; iter++) {
+        for (iter = 0; (iter < num_iter) || (bench_duration != 0); iter++) {
             failcode = DoIO((struct IORequest *) tio[0]);
             if ((failcode != 0) && (iocmd != CMD_INVALID)) {
                 rc++;
                 break;
             }
+            state = latency_sample(&warming, &stime, &ltime);
+            measured = (state == TIMED_RESTART) ? 0 : measured + 1;
+            if (state == TIMED_DONE)
+                break;
         }
     }
 
     ReadEClock(&etime);
-    print_latency(diff_e_clock(&stime, &etime), iter, ' ');
+    print_latency(diff_e_clock(&stime, &etime), measured,
+                  (rc != 0) ? ' ' : '\n');
     if (rc != 0)  {
-        printf(" ");
-        print_fail(failcode);
+        print_msg(" ");
+        print_msg_fail(failcode);
+        print_msg("\n");
     }
-    printf("\n");
+    if (flag_lat_hist)
+        print_lat_hist(&g_lat_hist);
     return (rc);
 }
 
@@ -1844,6 +2583,15 @@ latency_cmd_par(UWORD iocmd, uint8_t *buf, int num_iter, struct IOExtTD **tio)
         tio[iter]->iotd_Req.io_Error   = 0xa5;
     }
 
+    /*
+     * All requests are issued at once, so the latency recorded for each
+     * request is from the start of the batch until it is complete.
+     */
+    g_result_buf = buf;
+    g_result_tio = num_iter;
+    if ((iocmd == CMD_READ) || (iocmd == CMD_WRITE))
+        g_result_xfer = BUFSIZE;
+    lat_hist_clear(&g_lat_hist);
     ReadEClock(&stime);
     for (iter = 0; iter < num_iter; iter++) {
         SendIO((struct IORequest *) tio[iter]);
@@ -1852,13 +2600,18 @@ latency_cmd_par(UWORD iocmd, uint8_t *buf, int num_iter, struct IOExtTD **tio)
         failcode = WaitIO((struct IORequest *) tio[iter]);
         if (failcode != 0) {
             if (++rc < 10) {
-                printf("  ");
-                print_fail(failcode);
+                print_msg("  ");
+                print_msg_fail(failcode);
             }
+        } else if (flag_lat_hist) {
+            ReadEClock(&etime);
+            lat_hist_add(&g_lat_hist, diff_e_clock(&stime, &etime));
         }
     }
     ReadEClock(&etime);
     print_latency(diff_e_clock(&stime, &etime), iter, '\n');
+    if (flag_lat_hist)
+        print_lat_hist(&g_lat_hist);
     return (rc);
 }
 
@@ -1893,14 +2646,16 @@ latency_scsidirect_cmd_seq(uint8_t iocmd, uint8_t *buf, int num_iter,
         tio[iter]->iotd_Req.io_Data    = scmd + iter;
     }
 
+    g_result_buf  = buf;
+    g_result_xfer = BUFSIZE;
     ReadEClock(&stime);
     for (iter = 0; iter < num_iter; iter++) {
         failcode = DoIO((struct IORequest *) tio[iter]);
         if (failcode != 0) {
             rc += failcode;
             if (++rc < 10) {
-                printf("  ");
-                print_fail(failcode);
+                print_msg("  ");
+                print_msg_fail(failcode);
             }
             break;
         }
@@ -1943,6 +2698,9 @@ latency_scsidirect_cmd_par(uint8_t iocmd, uint8_t *buf, int num_iter,
         tio[iter]->iotd_Req.io_Data    = scmd + iter;
     }
 
+    g_result_buf  = buf;
+    g_result_xfer = BUFSIZE;
+    g_result_tio  = num_iter;
     ReadEClock(&stime);
     for (iter = 0; iter < num_iter; iter++) {
         SendIO((struct IORequest *) tio[iter]);
@@ -1951,8 +2709,8 @@ latency_scsidirect_cmd_par(uint8_t iocmd, uint8_t *buf, int num_iter,
         int failcode = WaitIO((struct IORequest *) tio[iter]);
         if (failcode != 0) {
             if (++rc < 10) {
-                printf("  ");
-                print_fail(failcode);
+                print_msg("  ");
+                print_msg_fail(failcode);
             }
         }
     }
@@ -1999,7 +2757,7 @@ latency_read(struct IOExtTD **tio, int max_iter)
 
     if (is_user_abort()) {
 user_abort:
-        printf("^C abort\n");
+        print_msg("^C abort\n");
         rc++;
         goto finish_fail;
     }
@@ -2125,6 +2883,204 @@ latency_write(struct IOExtTD **tio, int max_iter)
     return (rc);
 }
 
+#define BREAKDOWN_SIZES 4      // Read sizes: 512 bytes to 32 KB
+#define BREAKDOWN_MAX   32768  // Largest read size
+#define BREAKDOWN_ITERS 32     // Reads timed at each size
+#define BREAKDOWN_CHART 40     // Width of stacked breakdown bar
+
+/*
+ * breakdown_read
+ * --------------
+ * Time BREAKDOWN_ITERS reads of len bytes at the start of the device,
+ * using the specified command path, and return the average in
+ * nanoseconds. The reads are repeated at the same offset so that the
+ * drive cache satisfies them, leaving no seek or rotation.
+ */
+static int
+breakdown_read(struct IOExtTD *tio, UWORD iocmd, struct SCSICmd *scmd,
+               uint8_t *buf, uint len, uint64_t *nsec)
+{
+    scsi_generic_t cmd;
+    struct EClockVal stime;
+    struct EClockVal etime;
+    uint32_t lba = g_devstart / g_sector_size;
+    int      failcode = 0;
+    int      iter;
+
+    if (iocmd == HD_SCSICMD) {
+        memset(&cmd, 0, sizeof (cmd));
+        cmd.opcode   = SCSI_READ_10_COMMAND;
+        cmd.bytes[1] = lba >> 24;
+        cmd.bytes[2] = lba >> 16;
+        cmd.bytes[3] = lba >> 8;
+        cmd.bytes[4] = lba;
+        cmd.bytes[6] = (len / g_sector_size) >> 8;
+        cmd.bytes[7] = len / g_sector_size;
+    }
+    ReadEClock(&stime);
+    for (iter = 0; (iter < BREAKDOWN_ITERS) && (failcode == 0); iter++) {
+        if (iocmd == HD_SCSICMD) {
+            setup_scsidirect_cmd(scmd, &cmd, 10, buf, len);
+            tio->iotd_Req.io_Length = sizeof (*scmd);
+            tio->iotd_Req.io_Data   = scmd;
+        } else {
+            tio->iotd_Req.io_Length = len;
+            tio->iotd_Req.io_Data   = buf;
+        }
+        tio->iotd_Req.io_Command = iocmd;
+        tio->iotd_Req.io_Actual  = g_devstart >> 32;
+        tio->iotd_Req.io_Offset  = (uint32_t) g_devstart;
+        tio->iotd_Req.io_Flags   = 0;
+        failcode = DoIO((struct IORequest *) tio);
+        if ((failcode == 0) && (iocmd == HD_SCSICMD) &&
+            (scmd->scsi_Status != 0))
+            failcode = HFERR_BadStatus;
+    }
+    ReadEClock(&etime);
+    *nsec = diff_e_clock(&stime, &etime) * 1000000000 / g_e_freq /
+            BREAKDOWN_ITERS;
+    return (failcode);
+}
+
+/*
+ * latency_breakdown
+ * -----------------
+ * Attribute read latency on each command path to Exec I/O, message
+ * passing, driver dispatch, device command overhead, and data transfer.
+ * The first three come from the command latencies measured earlier:
+ *     Exec      CMD_INVALID, which the driver rejects immediately
+ *     Message   TD_CHANGENUM less TD_CHANGENUM quick (the reply message)
+ *     Driver    TD_CHANGENUM quick less CMD_INVALID
+ * Reads of several sizes are fit to a line. The slope is the transfer
+ * time per byte, and the intercept less the above is the device command
+ * overhead.
+ */
+static int
+latency_breakdown(struct IOExtTD *tio)
+{
+    static const struct {
+        UWORD       cmd;
+        const char *name;
+    } paths[] = {
+        { CMD_READ,        "CMD_READ" },
+        { TD_READ64,       "TD_READ64" },
+        { NSCMD_TD_READ64, "NSCMD_TD_READ64" },
+        { HD_SCSICMD,      "HD_SCSICMD" },
+    };
+    static const char parts[] = "EMDCT";
+    struct SCSICmd *scmd;
+    uint8_t *buf;
+    uint64_t nsec[BREAKDOWN_SIZES];
+    int64_t  sx;
+    int64_t  sy;
+    int64_t  sxx;
+    int64_t  sxy;
+    int64_t  slope;      // Nanoseconds per 512 bytes
+    int64_t  intercept;  // Nanoseconds
+    uint     usec[6];    // Exec, message, driver, command, transfer, total
+    uint     sum;
+    uint     path;
+    uint     part;
+    uint     pos;
+    uint     len;
+    uint     bar;
+    int      rc;
+
+    usec[0] = result_find("CMD_INVALID", 0);
+    usec[1] = result_find("TD_CHANGENUM", 0);
+    usec[2] = result_find("TD_CHANGENUM quick", 0);
+    usec[1] = (usec[1] > usec[2]) ? usec[1] - usec[2] : 0;
+    usec[2] = (usec[2] > usec[0]) ? usec[2] - usec[0] : 0;
+
+    if ((rc = open_device(tio)) != 0) {
+        printf("Open %s Unit %u: ", g_devname, g_unitno);
+        print_fail_nl(rc);
+        return (1);
+    }
+    if (g_sector_size == 0)
+        g_sector_size = 512;
+    buf = AllocMemType(BREAKDOWN_MAX, memtype);
+    scmd = AllocMemType(sizeof (*scmd), memtype);
+    if ((buf == NULL) || (scmd == NULL)) {
+        report_allocmem_fail((buf == NULL) ? BREAKDOWN_MAX : sizeof (*scmd),
+                             memtype);
+        rc = 1;
+        goto breakdown_fail;
+    }
+
+    if (g_output == OUTPUT_TEXT) {
+        printf("\nRead latency breakdown at %u KB (usec)\n",
+               BREAKDOWN_MAX / 1024);
+        printf("Path              Exec   Msg Driver Command Transfer "
+               " Total  KB/sec\n");
+    }
+    for (path = 0; path < ARRAY_SIZE(paths); path++) {
+        sx = sy = sxx = sxy = 0;
+        for (pos = 0; pos < BREAKDOWN_SIZES; pos++) {
+            len = 512 << (pos * 2);
+            if (len < g_sector_size)
+                len = g_sector_size;
+            if (breakdown_read(tio, paths[path].cmd, scmd, buf, len,
+                               &nsec[pos]) != 0)
+                break;
+            if (g_output != OUTPUT_TEXT) {
+                char name[32];
+                sprintf(name, "breakdown %s", paths[path].name);
+                lat_hist_clear(&g_lat_hist);
+                print_result(name, 0, len, 1, buf,
+                             nsec[pos] * BREAKDOWN_ITERS * g_e_freq /
+                             1000000000, (uint64_t) len *
+                             BREAKDOWN_ITERS, BREAKDOWN_ITERS,
+                             nsec[pos] / 1000);
+            }
+            sx  += len / 512;
+            sy  += nsec[pos];
+            sxx += (int64_t) (len / 512) * (len / 512);
+            sxy += (int64_t) (len / 512) * nsec[pos];
+        }
+        if (g_output != OUTPUT_TEXT)
+            continue;
+        printf("%-16s", paths[path].name);
+        if (pos < BREAKDOWN_SIZES) {
+            printf(" not supported\n");
+            continue;
+        }
+        slope = (BREAKDOWN_SIZES * sxy - sx * sy) /
+                (BREAKDOWN_SIZES * sxx - sx * sx);
+        if (slope < 1)
+            slope = 1;
+        intercept = (sy - slope * sx) / BREAKDOWN_SIZES;
+        if (intercept < 0)
+            intercept = 0;
+        sum = usec[0] + usec[1] + usec[2];
+        usec[3] = (intercept / 1000 > sum) ? intercept / 1000 - sum : 0;
+        usec[4] = slope * (BREAKDOWN_MAX / 512) / 1000;
+        usec[5] = nsec[BREAKDOWN_SIZES - 1] / 1000;
+        printf("%6u %5u %6u %7u %8u %6u %7u\n",
+               usec[0], usec[1], usec[2], usec[3], usec[4], usec[5],
+               (uint) (512000000 / slope));
+
+        sum += usec[3] + usec[4];
+        if (sum == 0)
+            sum = 1;
+        printf("  ");
+        for (part = 0; part < 5; part++)
+            for (bar = usec[part] * BREAKDOWN_CHART / sum; bar > 0; bar--)
+                printf("%c", parts[part]);
+        printf("\n");
+    }
+    if (g_output == OUTPUT_TEXT)
+        printf("  E=Exec M=Message D=Driver C=Command T=Transfer\n");
+
+breakdown_fail:
+    if (scmd != NULL)
+        FreeMemType(scmd, sizeof (*scmd));
+    if (buf != NULL)
+        FreeMemType(buf, BREAKDOWN_MAX);
+    close_device(tio);
+    return (rc);
+}
+
 static int
 drive_latency(int do_destructive)
 {
@@ -2144,6 +3100,7 @@ drive_latency(int do_destructive)
         return (1);
     }
 
+    lat_hist_clear(&g_lat_hist);
     print_ltest_name("OpenDevice / CloseDevice");
 
     tio = (struct IOExtTD *) CreateExtIO(mp, sizeof (struct IOExtTD));
@@ -2236,6 +3193,7 @@ drive_latency(int do_destructive)
 
     if ((latency_getgeometry(mtio, NUM_MTIO / 4)) ||
         (latency_read(mtio, NUM_MTIO)) ||
+        (latency_breakdown(mtio[0])) ||
         (do_destructive && latency_write(mtio, NUM_MTIO))) {
         rc = 1;
     }
@@ -2256,12 +3214,37 @@ need_delete_port:
     return (rc);
 }
 
+/*
+ * rand32
+ * ------
+ * Very simple pseudo-random number generator
+ */
+static uint32_t rand_seed = 0;
+static uint32_t
+rand32(void)
+{
+    rand_seed = (rand_seed * 25173) + 13849;
+    return (rand_seed);
+}
+
+/*
+ * srand32
+ * -------
+ * Very simple random number seed
+ */
+static void
+srand32(uint32_t seed)
+{
+    rand_seed = seed;
+}
+
 #define PERF_BUF_SIZE (512 << 10)
 #define NUM_TIO       4
 #define MAX_NUM_TIO   32
 
 static void
-print_perf(uint ttime, uint freq, uint xfer_kb, int is_write, uint xfer_size)
+print_perf(uint64_t ttime, uint freq, uint xfer_kb, int is_write,
+           uint xfer_size)
 {
     uint tsec;
     uint trem;
@@ -2278,129 +3261,3546 @@ print_perf(uint ttime, uint freq, uint xfer_kb, int is_write, uint xfer_size)
     tsec = ttime / freq;
     trem = ttime % freq;
 
-    if ((xfer_kb * (freq / 1000) / ttime) >= 100) {
+    if (((uint64_t) xfer_kb * (freq / 1000) / ttime) >= 100) {
         /* Transfer rate > about 100 MB/sec */
         xfer_kb /= 1000;
         c2 = 'M';
     }
     xfer_kb = (uint64_t) xfer_kb * (uint64_t) freq / (uint64_t) ttime;
 
-    if (g_verbose) {
-        printf("%4u %cB %s in %2u.%02u sec: %3u KB xfer: %3u %cB/sec\n",
-               rep, c1, is_write ? "write" : "read ",
-               tsec, trem * 100 / freq, xfer_size / 1024,
-               xfer_kb, c2);
-    } else {
-        printf("%13u %cB/sec\n", xfer_kb, c2);
+    if (g_verbose) {
+        printf("%4u %cB %s in %2u.%02u sec: %3u KB xfer: %3u %cB/sec",
+               rep, c1, is_write ? "write" : "read ",
+               tsec, trem * 100 / freq, xfer_size / 1024,
+               xfer_kb, c2);
+    } else {
+        printf("%13u %cB/sec", xfer_kb, c2);
+    }
+}
+
+static uint32_t user_perf_size = 0;
+static uint     user_num_tio   = 0;
+static uint     repeat_ci      = 0;   // Target confidence interval (-r)
+static uint     repeat_max     = 20;  // Maximum repetitions (-r)
+static uint64_t bench_offset   = 0;   // Bandwidth test device offset (-s)
+static uint64_t fresh_start;          // First offset past cached area (-n)
+static uint64_t fresh_end;            // End of device or partition (-n)
+static uint64_t fresh_pos;            // Next unread device offset (-n)
+static uint64_t bench_wrap_end = 0;   // -T wrap offset, if not device end
+
+#define BANDWIDTH_XFERS 50  // Maximum transfers per bandwidth measurement
+
+static int
+iocmd_is_write(UWORD iocmd)
+{
+    return ((iocmd == CMD_WRITE) || (iocmd == TD_WRITE64) ||
+            (iocmd == NSCMD_TD_WRITE64));
+}
+
+/*
+ * iocmd_for_end
+ * -------------
+ * Return the read or write command able to reach the specified device
+ * end offset: CMD_READ / CMD_WRITE below 4 GB, otherwise the NSD or TD64
+ * equivalent.
+ */
+static UWORD
+iocmd_for_end(UWORD iocmd, uint64_t end)
+{
+    if ((end >> 32) == 0)
+        return (iocmd);
+    if (iocmd_is_write(iocmd))
+        return (g_has_nsd ? NSCMD_TD_WRITE64 : TD_WRITE64);
+    return (g_has_nsd ? NSCMD_TD_READ64 : TD_READ64);
+}
+
+/*
+ * fresh_init
+ * ----------
+ * Set up the device area used by -n to read from places that the
+ * benchmark has not recently read, so that a drive cache can not
+ * satisfy the request. The area begins past what the standard bandwidth
+ * test reads at its start offset, and runs to the end of the device or
+ * partition.
+ */
+static int
+fresh_init(uint32_t bufsize)
+{
+    uint64_t cached = (uint64_t) bufsize * BANDWIDTH_XFERS;
+
+    dev_range(&fresh_start, &fresh_end);
+    if (fresh_start < bench_offset + cached)
+        fresh_start = bench_offset + cached;
+    fresh_pos   = fresh_start;
+    if (fresh_end < fresh_start + cached) {
+        print_msg("Device too small for uncached reads\n");
+        return (1);
+    }
+    return (0);
+}
+
+/*
+ * fresh_next
+ * ----------
+ * Return the device offset of the next unread area of the specified
+ * length. After reaching the end of the device, areas are reused from
+ * the start, by which time they should long have left the drive cache.
+ */
+static uint64_t
+fresh_next(uint64_t len)
+{
+    uint64_t pos;
+
+    if (fresh_pos + len > fresh_end)
+        fresh_pos = fresh_start;
+    pos = fresh_pos;
+    fresh_pos += len;
+    return (pos);
+}
+
+/*
+ * CPU utilization is measured with a task at the lowest priority which
+ * counts as fast as it can whenever nothing else wants the CPU. Its
+ * count rate is first calibrated with devtest asleep. During a test,
+ * the shortfall from that rate is the CPU time consumed by devtest, the
+ * device driver, and interrupt handlers (PIO drivers keep the CPU busy,
+ * while DMA drivers should leave most of it idle).
+ */
+#define CPU_IDLE_PRI   -127
+#define CPU_IDLE_STACK 4096
+#define CPU_CAL_TICKS  25    // DOS ticks (1/50 sec) to calibrate idle rate
+
+static volatile uint32_t cpu_idle_count;  // Read with modular difference
+static struct Task      *cpu_idle_task;
+static uint32_t          cpu_cal_count;  // Idle counts during calibration
+static uint32_t          cpu_cal_ticks;  // EClock ticks of calibration
+
+static void
+cpu_idle_loop(void)
+{
+    for (;;)
+        cpu_idle_count++;
+}
+
+static void
+cpu_idle_stop(void)
+{
+    if (cpu_idle_task != NULL) {
+        /* The idle task never runs while devtest is ready, so is safe */
+        DeleteTask(cpu_idle_task);
+        cpu_idle_task = NULL;
+    }
+}
+
+/*
+ * cpu_idle_start
+ * --------------
+ * Start the idle counting task and calibrate the rate at which it counts
+ * while the system is otherwise idle.
+ */
+static int
+cpu_idle_start(void)
+{
+    struct EClockVal stime;
+    struct EClockVal etime;
+    uint32_t count;
+
+    /* Cast through ULONG: ISO C has no function to object pointer cast */
+    cpu_idle_task = CreateTask("devtest idle", CPU_IDLE_PRI,
+                               (APTR) (ULONG) cpu_idle_loop, CPU_IDLE_STACK);
+    if (cpu_idle_task == NULL) {
+        printf("Failed to create CPU idle task\n");
+        return (1);
+    }
+    Delay(1);  // Let the idle task get started
+
+    count = cpu_idle_count;
+    ReadEClock(&stime);
+    Delay(CPU_CAL_TICKS);
+    ReadEClock(&etime);
+    cpu_cal_count = cpu_idle_count - count;
+    cpu_cal_ticks = diff_e_clock(&stime, &etime);
+    if ((cpu_cal_count == 0) || (cpu_cal_ticks == 0)) {
+        printf("CPU idle task did not run; is the system busy?\n");
+        cpu_idle_stop();
+        return (1);
+    }
+    if (g_verbose) {
+        printf("CPU idle rate %u counts/sec\n",
+               (uint) ((uint64_t) cpu_cal_count * g_e_freq / cpu_cal_ticks));
+    }
+    return (0);
+}
+
+/*
+ * cpu_busy
+ * --------
+ * Return the CPU busy percentage (x10) over the specified number of EClock
+ * ticks, given the idle task count at the start of that period.
+ */
+static uint
+cpu_busy(uint32_t idle_start, uint64_t ticks)
+{
+    uint64_t idle;
+    uint64_t full;
+
+    if ((cpu_idle_task == NULL) || (ticks == 0))
+        return (CPU_BUSY_NONE);
+
+    full = (uint64_t) cpu_cal_count * ticks / cpu_cal_ticks;
+    if (full == 0)
+        return (CPU_BUSY_NONE);
+    /* A 32-bit count is read atomically; the difference survives wrap */
+    idle = (uint64_t) (uint32_t) (cpu_idle_count - idle_start) * 1000 / full;
+    if (idle > 1000)
+        idle = 1000;
+    return (1000 - (uint) idle);
+}
+
+/*
+ * print_cpu_busy
+ * --------------
+ * Append CPU utilization and efficiency (MB/sec per percent of CPU) to a
+ * bandwidth result line.
+ */
+static void
+print_cpu_busy(uint busy, uint kb_per_sec)
+{
+    uint per;
+
+    if (busy == CPU_BUSY_NONE)
+        return;
+    printf("  CPU %3u.%u%%", busy / 10, busy % 10);
+    if (busy != 0) {
+        per = (uint64_t) kb_per_sec * 10 / busy;  // KB/sec per CPU %
+        printf("  %u.%02u MB/sec per CPU %%", per / 1000, per % 1000 / 10);
+    }
+}
+
+/*
+ * run_bandwidth_xfers
+ * -------------------
+ * Issue up to max_xfers sequential transfers of bufsize bytes starting at
+ * the specified device offset, keeping num_tio requests outstanding. The
+ * elapsed EClock ticks and the number of successful transfers are returned
+ * to the caller. With -H, request latencies are added to g_lat_hist,
+ * which the caller must clear. With -u, CPU utilization of the run is
+ * left in g_cpu_busy.
+ *
+ * With -T, max_xfers is ignored. Transfers continue through a warm-up
+ * interval, which is not counted, and then for the specified duration.
+ * The position wraps back to the start offset at bench_wrap_end if set,
+ * otherwise at the end of the device.
+ */
+static int
+run_bandwidth_xfers(UWORD iocmd, struct IOExtTD **tio, uint8_t **buf,
+                    uint32_t bufsize, uint num_tio, uint64_t pos,
+                    uint max_xfers, uint64_t *ticks, uint *xfers)
+{
+    uint xfer;
+    uint xfer_good = 0;
+    uint i;
+    int rc = 0;
+    uint32_t issued = 0;
+    uint cur = 0;
+    uint warming = (bench_warmup != 0);
+    uint64_t pos_start = pos;
+    uint64_t pos_end = g_devend;
+    struct EClockVal stime;
+    struct EClockVal etime;
+    struct EClockVal itime[MAX_NUM_TIO];
+    uint32_t idle_start = cpu_idle_count;
+
+    if (bench_duration != 0) {
+        max_xfers = 0xffffffff;
+        if (bench_wrap_end != 0)
+            pos_end = bench_wrap_end;
+        else if (pos_end == 0)
+            pos_end = g_devsize;
+        if ((iocmd == CMD_READ) || (iocmd == CMD_WRITE)) {
+            /* 32-bit commands can't go beyond 4 GB */
+            if ((pos_end == 0) || ((pos_end >> 32) != 0))
+                pos_end = (uint64_t) 1 << 32;
+        }
+    }
+
+    ReadEClock(&stime);
+
+    for (xfer = 0; xfer < max_xfers; xfer++) {
+        if (issued & BIT(cur)) {
+            int failcode = tio_wait(tio[cur]);
+            issued &= ~BIT(cur);
+            if (failcode == 0) {
+                xfer_good++;
+                if (flag_lat_hist || (bench_duration != 0))
+                    ReadEClock(&etime);
+                if (flag_lat_hist) {
+                    lat_hist_add(&g_lat_hist,
+                                 diff_e_clock(&itime[cur], &etime));
+                }
+            } else {
+                print_io_fail(iocmd_is_write(iocmd) ? "  Write" : "  Read",
+                              failcode, U32(tio[cur]->iotd_Req.io_Offset));
+                rc++;
+                break;
+            }
+            if (bench_duration != 0) {
+                int state = timed_check(&warming, &stime, &etime);
+                if (state == TIMED_DONE)
+                    break;
+                if (state == TIMED_RESTART) {
+                    xfer_good = 0;
+                    idle_start = cpu_idle_count;
+                }
+            } else if ((xfer & 0x7) == 0) {
+                /* Cut out early if device is slow (> 1 second) */
+                ReadEClock(&etime);
+                if (diff_e_clock(&stime, &etime) > g_e_freq) {
+                    break;
+                }
+            }
+        }
+        if ((bench_duration != 0) && (pos + bufsize > pos_end))
+            pos = pos_start;
+
+        tio[cur]->iotd_Req.io_Command = iocmd;
+        tio[cur]->iotd_Req.io_Actual = pos >> 32;
+        tio[cur]->iotd_Req.io_Data = buf[cur];
+        tio[cur]->iotd_Req.io_Length = bufsize;
+        tio[cur]->iotd_Req.io_Offset = (uint32_t) pos;
+        if (flag_lat_hist)
+            ReadEClock(&itime[cur]);
+        SendIO((struct IORequest *) tio[cur]);
+        issued |= BIT(cur);
+        pos += bufsize;
+        if (++cur >= num_tio)
+            cur = 0;
+    }
+    for (i = 0; i < num_tio; i++) {
+        if (issued & BIT(cur)) {
+            int failcode = tio_wait(tio[cur]);
+            issued &= ~BIT(cur);
+            if (failcode == 0) {
+                xfer_good++;
+                if (flag_lat_hist) {
+                    ReadEClock(&etime);
+                    lat_hist_add(&g_lat_hist,
+                                 diff_e_clock(&itime[cur], &etime));
+                }
+            } else {
+                print_io_fail(iocmd_is_write(iocmd) ? "  Write" : "  Read",
+                              failcode, U32(tio[cur]->iotd_Req.io_Offset));
+                rc++;
+            }
+        }
+        if (++cur >= num_tio)
+            cur = 0;
+    }
+
+    ReadEClock(&etime);
+    *ticks = diff_e_clock(&stime, &etime);
+    *xfers = xfer_good;
+    g_cpu_busy = cpu_busy(idle_start, *ticks);
+
+    return (rc);
+}
+
+static uint32_t
+isqrt(uint64_t value)
+{
+    uint64_t bit = (uint64_t) 1 << 62;
+    uint64_t res = 0;
+
+    while (bit > value)
+        bit >>= 2;
+    while (bit != 0) {
+        if (value >= res + bit) {
+            value -= res + bit;
+            res = (res >> 1) + bit;
+        } else {
+            res >>= 1;
+        }
+        bit >>= 2;
+    }
+    return ((uint32_t) res);
+}
+
+#define REPEAT_MIN 3  // Minimum samples before checking confidence
+
+/*
+ * Student's t value (x100) for a two-sided 95% confidence interval,
+ * indexed by degrees of freedom - 1. Above 30, 1.96 is used.
+ */
+static const uint16_t t95_x100[] = {
+    1271, 430, 318, 278, 257, 245, 236, 231, 226, 223,
+     220, 218, 216, 214, 213, 212, 211, 210, 209, 209,
+     208, 207, 207, 206, 206, 206, 205, 205, 205, 204,
+};
+
+/*
+ * run_bandwidth_repeat
+ * --------------------
+ * Repeat a bandwidth measurement until the 95% confidence interval of
+ * the mean is within repeat_ci percent of the mean, or until repeat_max
+ * samples have been taken. Reports mean, confidence interval, standard
+ * deviation, minimum, maximum, and sample count.
+ */
+static int
+run_bandwidth_repeat(UWORD iocmd, struct IOExtTD **tio, uint8_t **buf,
+                     uint32_t bufsize, uint num_tio)
+{
+    uint64_t sum = 0;
+    uint64_t sumsq = 0;
+    uint64_t diff_ticks;
+    uint     xfer_good;
+    uint     rate;
+    uint     rate_min = 0xffffffff;
+    uint     rate_max = 0;
+    uint     mean = 0;
+    uint     sdev = 0;
+    uint     half = 0;
+    uint     t;
+    uint     n = 0;
+    uint     busy_sum = 0;
+    uint64_t pos = bench_offset;
+    UWORD    cmd = iocmd_for_end(iocmd, pos + bufsize * BANDWIDTH_XFERS);
+    int      rc = 0;
+
+    while (n < repeat_max) {
+        if (flag_nocache && (iocmd == CMD_READ)) {
+            pos = fresh_next((uint64_t) bufsize * BANDWIDTH_XFERS);
+            cmd = iocmd_for_end(iocmd, pos + bufsize * BANDWIDTH_XFERS);
+        }
+        rc += run_bandwidth_xfers(cmd, tio, buf, bufsize, num_tio, pos,
+                                  BANDWIDTH_XFERS, &diff_ticks, &xfer_good);
+        if (rc != 0)
+            break;
+        rate = calc_kb_per_sec((uint64_t) bufsize * xfer_good, diff_ticks);
+        busy_sum += g_cpu_busy;
+        if (g_output != OUTPUT_TEXT) {
+            print_result((iocmd == CMD_READ) ? "read" : "write", pos,
+                         bufsize, num_tio, buf[0], diff_ticks,
+                         (uint64_t) bufsize * xfer_good, xfer_good, 0);
+        }
+        n++;
+        sum += rate;
+        sumsq += (uint64_t) rate * rate;
+        if (rate_min > rate)
+            rate_min = rate;
+        if (rate_max < rate)
+            rate_max = rate;
+        mean = sum / n;
+        if (n < 2)
+            continue;
+
+        sdev = isqrt((sumsq - sum * sum / n) / (n - 1));
+        t = (n - 1 <= ARRAY_SIZE(t95_x100)) ? t95_x100[n - 2] : 196;
+        half = (uint64_t) t * sdev / isqrt((uint64_t) n * 10000);
+        if ((n >= REPEAT_MIN) &&
+            ((uint64_t) half * 100 <= (uint64_t) repeat_ci * mean)) {
+            break;
+        }
+        if (is_user_abort())
+            break;
+    }
+    if (n == 0)
+        return (rc);
+
+    result_save((iocmd == CMD_READ) ? "read" : "write", bufsize, mean, 1);
+    if (g_output == OUTPUT_TEXT) {
+        uint ci = (mean == 0) ? 0 : (uint) ((uint64_t) half * 1000 / mean);
+        if (g_verbose)
+            printf("%s %3u KB xfers ",
+                   (iocmd == CMD_READ) ? "read " : "write", bufsize / 1024);
+        printf("%13u KB/sec +/-%u.%u%% sd %u min %u max %u n %u",
+               mean, ci / 10, ci % 10, sdev, rate_min, rate_max, n);
+        print_cpu_busy((cpu_idle_task == NULL) ? CPU_BUSY_NONE :
+                       busy_sum / n, mean);
+        printf("\n");
+    }
+    return (rc);
+}
+
+/*
+ * run_bandwidth_uncached
+ * ----------------------
+ * Measure read bandwidth of an area at the start of the device which was
+ * just read (and so is likely to be in the drive cache), and of an area
+ * which has not been read by this benchmark. Both are reported side by
+ * side; the uncached rate is saved as the "read" result.
+ */
+static int
+run_bandwidth_uncached(struct IOExtTD **tio, uint8_t **buf,
+                       uint32_t bufsize, uint num_tio)
+{
+    uint64_t len = (uint64_t) bufsize * BANDWIDTH_XFERS;
+    uint64_t pos;
+    uint64_t diff_ticks;
+    uint     xfer_good;
+    uint     cached;
+    uint     uncached;
+    int      rc;
+
+    UWORD    cmd = iocmd_for_end(CMD_READ, bench_offset + len);
+
+    /* First read fills the drive cache */
+    rc = run_bandwidth_xfers(cmd, tio, buf, bufsize, num_tio, bench_offset,
+                             BANDWIDTH_XFERS, &diff_ticks, &xfer_good);
+    lat_hist_clear(&g_lat_hist);
+    if (rc == 0)
+        rc = run_bandwidth_xfers(cmd, tio, buf, bufsize, num_tio,
+                                 bench_offset, BANDWIDTH_XFERS, &diff_ticks,
+                                 &xfer_good);
+    if (rc != 0)
+        return (rc);
+    cached = calc_kb_per_sec((uint64_t) bufsize * xfer_good, diff_ticks);
+    result_save("read cached", bufsize, cached, 1);
+    if (g_output != OUTPUT_TEXT)
+        print_result("read cached", bench_offset, bufsize, num_tio, buf[0],
+                     diff_ticks, (uint64_t) bufsize * xfer_good, xfer_good,
+                     0);
+
+    pos = fresh_next(len);
+    lat_hist_clear(&g_lat_hist);
+    rc = run_bandwidth_xfers(iocmd_for_end(CMD_READ, pos + len), tio, buf,
+                             bufsize, num_tio, pos, BANDWIDTH_XFERS,
+                             &diff_ticks, &xfer_good);
+    uncached = calc_kb_per_sec((uint64_t) bufsize * xfer_good, diff_ticks);
+    result_save("read", bufsize, uncached, 1);
+    if (g_output != OUTPUT_TEXT) {
+        print_result("read", pos, bufsize, num_tio, buf[0], diff_ticks,
+                     (uint64_t) bufsize * xfer_good, xfer_good, 0);
+    } else {
+        if (g_verbose)
+            printf("read  %3u KB xfers ", bufsize / 1024);
+        printf("%13u KB/sec uncached %8u KB/sec cached", uncached, cached);
+        print_cpu_busy(g_cpu_busy, uncached);
+        printf("\n");
+    }
+    return (rc);
+}
+
+static int
+run_bandwidth(UWORD iocmd, struct IOExtTD **tio, uint8_t **buf,
+              uint32_t bufsize, uint num_tio)
+{
+    uint xfer_good;
+    uint rate;
+    int rc = 0;
+    uint64_t diff_ticks;
+    uint64_t xfer_total;
+
+    int rep;
+
+    for (rep = 0; rep < 10; rep++) {
+        print_perf_type((iocmd == CMD_READ) ? 0 : 1, bufsize);
+        lat_hist_clear(&g_lat_hist);
+        if (repeat_ci != 0) {
+            rc += run_bandwidth_repeat(iocmd, tio, buf, bufsize, num_tio);
+            goto next_size;
+        }
+        if (flag_nocache && (iocmd == CMD_READ)) {
+            rc += run_bandwidth_uncached(tio, buf, bufsize, num_tio);
+            goto next_size;
+        }
+        rc += run_bandwidth_xfers(iocmd_for_end(iocmd, bench_offset +
+                                                (uint64_t) bufsize *
+                                                BANDWIDTH_XFERS),
+                                  tio, buf, bufsize, num_tio, bench_offset,
+                                  BANDWIDTH_XFERS, &diff_ticks, &xfer_good);
+        rate = calc_kb_per_sec((uint64_t) bufsize * xfer_good, diff_ticks);
+        result_save((iocmd == CMD_READ) ? "read" : "write", bufsize, rate, 1);
+
+        if (g_output != OUTPUT_TEXT) {
+            print_result((iocmd == CMD_READ) ? "read" : "write",
+                         bench_offset, bufsize, num_tio, buf[0], diff_ticks,
+                         (uint64_t) bufsize * xfer_good, xfer_good, 0);
+        } else {
+            xfer_total = (uint64_t) bufsize * (uint64_t) xfer_good / 1000;
+            print_perf(diff_ticks, g_e_freq, (uint) xfer_total,
+                       (iocmd == CMD_READ) ? 0 : 1, bufsize);
+            print_cpu_busy(g_cpu_busy, rate);
+            printf("\n");
+        }
+next_size:
+        if (flag_lat_hist)
+            print_lat_hist(&g_lat_hist);
+        bufsize >>= 2;
+        if (bufsize < 16384)
+            break;
+
+        if (is_user_abort()) {
+            print_msg("^C abort\n");
+            rc++;
+            break;
+        }
+        if (user_perf_size != 0)
+            break;  // Only run the specified size
+    }
+
+    return (rc);
+}
+
+/*
+ * run_qdepth_sweep
+ * ----------------
+ * Measure bandwidth at each transfer size with 1, 2, 4, ... outstanding
+ * requests, up to max_tio. The result is a table of KB/sec with one row
+ * per transfer size and one column per queue depth.
+ */
+static int
+run_qdepth_sweep(UWORD iocmd, struct IOExtTD **tio, uint8_t **buf,
+                 uint32_t bufsize, uint max_tio)
+{
+    uint     qd;
+    uint     xfer_good;
+    uint64_t diff_ticks;
+    uint64_t pos = bench_offset;
+    UWORD    cmd = iocmd_for_end(iocmd, pos + bufsize * BANDWIDTH_XFERS);
+    int      rc = 0;
+
+    if (g_output == OUTPUT_TEXT) {
+        printf("%-19s",
+               (iocmd == CMD_READ) ? "read  KB/sec" : "write KB/sec");
+        for (qd = 1; qd <= max_tio; qd <<= 1)
+            printf(" %6s%-2u", "QD", qd);
+        printf("\n");
+    }
+
+    while (bufsize >= 16384) {
+        if (g_output == OUTPUT_TEXT)
+            printf("%s %3u KB xfers ",
+                   (iocmd == CMD_READ) ? "read " : "write", bufsize / 1024);
+        for (qd = 1; qd <= max_tio; qd <<= 1) {
+            lat_hist_clear(&g_lat_hist);
+            if (flag_nocache && (iocmd == CMD_READ)) {
+                pos = fresh_next((uint64_t) bufsize * BANDWIDTH_XFERS);
+                cmd = iocmd_for_end(iocmd,
+                                    pos + bufsize * BANDWIDTH_XFERS);
+            }
+            rc += run_bandwidth_xfers(cmd, tio, buf, bufsize, qd, pos,
+                                      BANDWIDTH_XFERS, &diff_ticks,
+                                      &xfer_good);
+            if (g_output != OUTPUT_TEXT) {
+                print_result((iocmd == CMD_READ) ? "qdepth read" :
+                             "qdepth write", pos, bufsize, qd, buf[0],
+                             diff_ticks, (uint64_t) bufsize * xfer_good,
+                             xfer_good, 0);
+            } else {
+                printf(" %8u",
+                       calc_kb_per_sec((uint64_t) bufsize * xfer_good,
+                                       diff_ticks));
+                fflush(stdout);
+            }
+            if (is_user_abort()) {
+                printf("\n^C abort\n");
+                return (rc + 1);
+            }
+        }
+        if (g_output == OUTPUT_TEXT)
+            printf("\n");
+        if (rc != 0)
+            break;
+        if (user_perf_size != 0)
+            break;  // Only run the specified size
+        bufsize >>= 2;
+    }
+    return (rc);
+}
+
+#define RANDOM_SEED_DEFAULT 1
+
+/*
+ * run_random_iops
+ * ---------------
+ * Measure small random transfer performance. Offsets are aligned to the
+ * transfer size and spread across the whole device or partition, using
+ * a fixed seed so that runs are repeatable. Each size runs for about one
+ * second (or the -T duration) with num_tio requests outstanding.
+ */
+static int
+run_random_iops(UWORD iocmd, struct IOExtTD **tio, uint8_t **buf,
+                uint num_tio, uint32_t seed)
+{
+    static const uint32_t sizes[] = { 512, 4096, 8192 };
+    struct EClockVal stime;
+    struct EClockVal etime;
+    struct EClockVal itime[MAX_NUM_TIO];
+    uint64_t start;
+    uint64_t end;
+    uint64_t blocks;
+    uint64_t pos;
+    uint64_t lat_total;
+    uint32_t issued;
+    uint64_t ticks;
+    uint     xfer_good;
+    uint     cur;
+    uint     stop;
+    uint     size;
+    uint     i;
+    uint     warming;
+    int      state;
+    int      rc = 0;
+    int      is_write = (iocmd == CMD_WRITE);
+
+    dev_range(&start, &end);
+    if (end <= start) {
+        print_msg("Device size unknown; can't run random test\n");
+        return (1);
+    }
+    iocmd = iocmd_for_end(iocmd, end);
+
+    for (i = 0; i < ARRAY_SIZE(sizes); i++) {
+        size = sizes[i];
+        if (size < g_sector_size)
+            continue;
+        blocks = (end - start) / size;
+        if (blocks == 0)
+            break;
+
+        srand32(seed);
+        lat_hist_clear(&g_lat_hist);
+        issued    = 0;
+        lat_total = 0;
+        xfer_good = 0;
+        stop      = 0;
+        cur       = 0;
+        warming   = (bench_warmup != 0);
+
+        ReadEClock(&stime);
+        while ((stop == 0) || (issued != 0)) {
+            if (issued & BIT(cur)) {
+                int failcode = tio_wait(tio[cur]);
+                issued &= ~BIT(cur);
+                ReadEClock(&etime);
+                if (failcode == 0) {
+                    ticks = diff_e_clock(&itime[cur], &etime);
+                    lat_total += ticks;
+                    lat_hist_add(&g_lat_hist, ticks);
+                    if (bench_duration != 0) {
+                        xfer_good++;
+                        state = timed_check(&warming, &stime, &etime);
+                        if (state == TIMED_DONE) {
+                            stop = 1;
+                        } else if (state == TIMED_RESTART) {
+                            lat_total = 0;
+                            xfer_good = 0;
+                        }
+                    } else if ((++xfer_good & 0x7) == 0) {
+                        if (diff_e_clock(&stime, &etime) > g_e_freq)
+                            stop = 1;
+                    }
+                } else {
+                    print_io_fail(is_write ? "  Write" : "  Read",
+                                  failcode, U32(tio[cur]->iotd_Req.io_Offset));
+                    rc++;
+                    stop = 1;
+                }
+            }
+            if (stop == 0) {
+                pos = (((uint64_t) rand32() << 32) | rand32()) % blocks;
+                pos = start + pos * size;
+                tio[cur]->iotd_Req.io_Command = iocmd;
+                tio[cur]->iotd_Req.io_Actual  = pos >> 32;
+                tio[cur]->iotd_Req.io_Offset  = (uint32_t) pos;
+                tio[cur]->iotd_Req.io_Data    = buf[cur];
+                tio[cur]->iotd_Req.io_Length  = size;
+                ReadEClock(&itime[cur]);
+                SendIO((struct IORequest *) tio[cur]);
+                issued |= BIT(cur);
+            }
+            if (++cur >= num_tio)
+                cur = 0;
+        }
+        ticks = diff_e_clock(&stime, &etime);
+        if (ticks == 0)
+            ticks = 1;
+
+        if (g_output != OUTPUT_TEXT) {
+            print_result(is_write ? "random write" : "random read", 0, size,
+                         num_tio, buf[0], ticks, (uint64_t) size * xfer_good,
+                         xfer_good,
+                         ticks_to_usec(lat_total /
+                                       (xfer_good ? xfer_good : 1)));
+        } else {
+            printf("random %s %4u byte xfers %8u IOPS  avg ",
+                   is_write ? "write" : "read ", size,
+                   (uint) ((uint64_t) xfer_good * g_e_freq / ticks));
+            print_latency((uint) (lat_total / (xfer_good ? xfer_good : 1)),
+                          1, '\n');
+        }
+        if (flag_lat_hist)
+            print_lat_hist(&g_lat_hist);
+        if (rc != 0)
+            break;
+        if (is_user_abort()) {
+            print_msg("^C abort\n");
+            rc++;
+            break;
+        }
+    }
+    return (rc);
+}
+
+#define MIXED_READ_PCT_DEFAULT 70
+
+/*
+ * parse_mixed_arg
+ * ---------------
+ * Parse the mixed workload test argument: [readpct[,tsize[,seq|random]]]
+ */
+static int
+parse_mixed_arg(const char *arg, uint *read_pct, uint *tsize, uint *is_random)
+{
+    int pos = 0;
+
+    if (arg == NULL)
+        return (0);
+    if ((sscanf(arg, "%u%n", read_pct, &pos) != 1) || (*read_pct > 100)) {
+        printf("Invalid read percentage \"%s\" (0 to 100)\n", arg);
+        return (1);
+    }
+    arg += pos;
+    if (*arg == ',') {
+        arg++;
+        if (isdigit((unsigned char) *arg)) {
+            parse_tsize(arg, tsize, &pos);
+            arg += pos;
+            if (*arg == ',')
+                arg++;
+        }
+    }
+    if (*arg == '\0')
+        return (0);
+    if (strncmp(arg, "rand", 4) == 0) {
+        *is_random = 1;
+    } else if (strncmp(arg, "seq", 3) == 0) {
+        *is_random = 0;
+    } else {
+        printf("Invalid access pattern \"%s\" (seq or random)\n", arg);
+        return (1);
+    }
+    return (0);
+}
+
+/*
+ * run_mixed
+ * ---------
+ * Run a workload of interleaved reads and writes for about one second
+ * (or the -T duration), keeping num_tio requests outstanding. Each
+ * request is a read with read_pct percent probability, otherwise a
+ * write, so that reads and writes are queued together on the unit.
+ * Access is either sequential through the device or random, aligned to
+ * the transfer size. Read and write throughput and latency are reported
+ * separately.
+ */
+static int
+run_mixed(struct IOExtTD **tio, uint8_t **buf, uint32_t size, uint num_tio,
+          uint read_pct, uint is_random)
+{
+    static lat_hist_t hist[2];
+    static const char * const names[] = { "mixed read", "mixed write" };
+    struct EClockVal stime;
+    struct EClockVal etime;
+    struct EClockVal itime[MAX_NUM_TIO];
+    uint8_t  op[MAX_NUM_TIO];  // 0 = read, 1 = write
+    uint64_t start;
+    uint64_t end;
+    uint64_t blocks;
+    uint64_t next = 0;
+    uint64_t pos;
+    uint64_t lat_total[2];
+    uint     xfer_good[2];
+    uint32_t issued = 0;
+    uint64_t ticks;
+    uint     cur = 0;
+    uint     stop = 0;
+    uint     warming = (bench_warmup != 0);
+    uint     rw;
+    UWORD    cmd[2];
+    int      rc = 0;
+
+    dev_range(&start, &end);
+    if (end <= start) {
+        print_msg("Device size unknown; can't run mixed test\n");
+        return (1);
+    }
+    blocks = (end - start) / size;
+    if (blocks == 0) {
+        print_msg("Device too small for %u byte mixed test\n", size);
+        return (1);
+    }
+    cmd[0] = iocmd_for_end(CMD_READ, end);
+    cmd[1] = iocmd_for_end(CMD_WRITE, end);
+
+    srand32(RANDOM_SEED_DEFAULT);
+    for (rw = 0; rw < 2; rw++) {
+        lat_hist_clear(&hist[rw]);
+        lat_total[rw] = 0;
+        xfer_good[rw] = 0;
+    }
+
+    ReadEClock(&stime);
+    while ((stop == 0) || (issued != 0)) {
+        if (issued & BIT(cur)) {
+            int failcode = tio_wait(tio[cur]);
+            issued &= ~BIT(cur);
+            ReadEClock(&etime);
+            rw = op[cur];
+            if (failcode == 0) {
+                ticks = diff_e_clock(&itime[cur], &etime);
+                lat_total[rw] += ticks;
+                lat_hist_add(&hist[rw], ticks);
+                xfer_good[rw]++;
+                if (bench_duration != 0) {
+                    int state = timed_check(&warming, &stime, &etime);
+                    if (state == TIMED_DONE) {
+                        stop = 1;
+                    } else if (state == TIMED_RESTART) {
+                        for (rw = 0; rw < 2; rw++) {
+                            lat_hist_clear(&hist[rw]);
+                            lat_total[rw] = 0;
+                            xfer_good[rw] = 0;
+                        }
+                    }
+                } else if (((xfer_good[0] + xfer_good[1]) & 0x7) == 0) {
+                    if (diff_e_clock(&stime, &etime) > g_e_freq)
+                        stop = 1;
+                }
+            } else {
+                print_io_fail(rw ? "  Write" : "  Read",
+                              failcode, U32(tio[cur]->iotd_Req.io_Offset));
+                rc++;
+                stop = 1;
+            }
+        }
+        if (stop == 0) {
+            if (is_random) {
+                pos = (((uint64_t) rand32() << 32) | rand32()) % blocks;
+            } else {
+                pos = next;
+                if (++next >= blocks)
+                    next = 0;
+            }
+            pos = start + pos * size;
+            rw = ((rand32() % 100) >= read_pct);
+            op[cur] = rw;
+            tio[cur]->iotd_Req.io_Command = cmd[rw];
+            tio[cur]->iotd_Req.io_Actual  = pos >> 32;
+            tio[cur]->iotd_Req.io_Offset  = (uint32_t) pos;
+            tio[cur]->iotd_Req.io_Data    = buf[cur];
+            tio[cur]->iotd_Req.io_Length  = size;
+            ReadEClock(&itime[cur]);
+            SendIO((struct IORequest *) tio[cur]);
+            issued |= BIT(cur);
+        }
+        if (++cur >= num_tio)
+            cur = 0;
+    }
+    ticks = diff_e_clock(&stime, &etime);
+    if (ticks == 0)
+        ticks = 1;
+
+    if (g_output == OUTPUT_TEXT) {
+        printf("mixed %u%% read ", read_pct);
+        if (size >= 1024)
+            printf("%u KB", size / 1024);
+        else
+            printf("%u byte", size);
+        printf(" %s xfers\n", is_random ? "random" : "sequential");
+    }
+    for (rw = 0; rw < 2; rw++) {
+        uint rate = calc_kb_per_sec((uint64_t) size * xfer_good[rw], ticks);
+        uint avg = lat_total[rw] / (xfer_good[rw] ? xfer_good[rw] : 1);
+
+        if (xfer_good[rw] == 0)
+            continue;
+        result_save(names[rw], size, rate, 1);
+        g_lat_hist = hist[rw];
+        if (g_output != OUTPUT_TEXT) {
+            print_result(names[rw], 0, size, num_tio, buf[0], ticks,
+                         (uint64_t) size * xfer_good[rw], xfer_good[rw],
+                         ticks_to_usec(avg));
+            continue;
+        }
+        printf("  %s %8u KB/sec %7u IOPS  avg ", rw ? "write" : "read ",
+               rate, (uint) ((uint64_t) xfer_good[rw] * g_e_freq / ticks));
+        print_latency(avg, 1, '\n');
+        if (flag_lat_hist)
+            print_lat_hist(&g_lat_hist);
+    }
+    return (rc);
+}
+
+#define LOADED_PROBE_TIO 31  // issued bit for the probe request
+
+/*
+ * run_loaded_phase
+ * ----------------
+ * Keep a sequential read stream going on num_tio requests, while a
+ * separate probe request issues psize random reads one at a time. Either
+ * may be omitted (num_tio of 0 or ptio of NULL) to measure the other
+ * alone. Runs for about one second or the -T duration. Stream completions
+ * and elapsed time are returned; probe latencies go to g_lat_hist.
+ */
+static int
+run_loaded_phase(struct IOExtTD **tio, uint8_t **buf, uint32_t bufsize,
+                 uint num_tio, struct IOExtTD *ptio, uint8_t *pbuf,
+                 uint32_t psize, uint64_t *ticks, uint *xfers)
+{
+    struct MsgPort  *mp;
+    struct IOExtTD  *cur_tio;
+    struct EClockVal stime;
+    struct EClockVal etime;
+    struct EClockVal ptime;
+    struct EClockVal done;
+    uint64_t start;
+    uint64_t end;
+    uint64_t pos   = bench_offset;
+    uint64_t pblocks;
+    uint64_t ppos;
+    uint32_t issued = 0;
+    uint     xfer_good = 0;
+    uint     warming = (bench_warmup != 0);
+    uint     stop = 0;
+    uint     cur;
+    int      failcode;
+    int      rc = 0;
+    UWORD    cmd;
+
+    dev_range(&start, &end);
+    if (end <= start) {
+        print_msg("Device size unknown; can't run loaded test\n");
+        return (1);
+    }
+    cmd = iocmd_for_end(CMD_READ, end);
+    pblocks = (end - start) / psize;
+    mp = ((ptio != NULL) ? ptio : tio[0])->iotd_Req.io_Message.mn_ReplyPort;
+    srand32(RANDOM_SEED_DEFAULT);
+    lat_hist_clear(&g_lat_hist);
+
+    ReadEClock(&stime);
+    done = stime;
+    while ((stop == 0) || (issued != 0)) {
+        /* Issue stream and probe requests which are not outstanding */
+        for (cur = 0; (cur < num_tio) && (stop == 0); cur++) {
+            if (issued & BIT(cur))
+                continue;
+            if (pos + bufsize > end)
+                pos = bench_offset;
+            tio[cur]->iotd_Req.io_Command = cmd;
+            tio[cur]->iotd_Req.io_Actual  = pos >> 32;
+            tio[cur]->iotd_Req.io_Offset  = (uint32_t) pos;
+            tio[cur]->iotd_Req.io_Data    = buf[cur];
+            tio[cur]->iotd_Req.io_Length  = bufsize;
+            SendIO((struct IORequest *) tio[cur]);
+            issued |= BIT(cur);
+            pos += bufsize;
+        }
+        if ((ptio != NULL) && (stop == 0) &&
+            ((issued & BIT(LOADED_PROBE_TIO)) == 0)) {
+            ppos = (((uint64_t) rand32() << 32) | rand32()) % pblocks;
+            ppos = start + ppos * psize;
+            ptio->iotd_Req.io_Command = cmd;
+            ptio->iotd_Req.io_Actual  = ppos >> 32;
+            ptio->iotd_Req.io_Offset  = (uint32_t) ppos;
+            ptio->iotd_Req.io_Data    = pbuf;
+            ptio->iotd_Req.io_Length  = psize;
+            ReadEClock(&ptime);
+            SendIO((struct IORequest *) ptio);
+            issued |= BIT(LOADED_PROBE_TIO);
+        }
+
+        /* Wait for any request to complete, then collect all that have */
+        WaitPort(mp);
+        ReadEClock(&etime);
+        for (cur = 0; cur <= LOADED_PROBE_TIO; cur++) {
+            if ((issued & BIT(cur)) == 0)
+                continue;
+            cur_tio = (cur == LOADED_PROBE_TIO) ? ptio : tio[cur];
+            if (CheckIO((struct IORequest *) cur_tio) == NULL)
+                continue;
+            failcode = tio_wait(cur_tio);
+            issued &= ~BIT(cur);
+            if (failcode != 0) {
+                if (rc++ == 0) {
+                    print_io_fail((cur == LOADED_PROBE_TIO) ?
+                                  "  Probe read" : "  Stream read", failcode,
+                                  U32(cur_tio->iotd_Req.io_Offset));
+                }
+                stop = 1;
+            } else if (stop) {
+                /* Draining outstanding requests after the end */
+            } else if (cur == LOADED_PROBE_TIO) {
+                lat_hist_add(&g_lat_hist, diff_e_clock(&ptime, &etime));
+            } else {
+                xfer_good++;
+            }
+        }
+        if (stop)
+            continue;
+        if (bench_duration != 0) {
+            int state = timed_check(&warming, &stime, &etime);
+            if (state == TIMED_RESTART)
+                xfer_good = 0;
+            else if (state == TIMED_DONE)
+                stop = 1;
+        } else if ((diff_e_clock(&stime, &etime) > g_e_freq) ||
+                   is_user_abort()) {
+            stop = 1;
+        }
+        done = etime;
+    }
+    *ticks = diff_e_clock(&stime, &done);
+    *xfers = xfer_good;
+    return (rc);
+}
+
+/*
+ * run_loaded
+ * ----------
+ * Measure how badly small random reads are starved by a large sequential
+ * read stream. The stream and the probe reads are each measured alone,
+ * and then together. The probe latency percentiles are reported next to
+ * the loss of stream throughput.
+ */
+static int
+run_loaded(struct IOExtTD **tio, uint8_t **buf, uint32_t bufsize,
+           uint num_tio, struct IOExtTD *ptio, uint32_t psize)
+{
+    static lat_hist_t idle_hist;
+    uint8_t *pbuf = g_tbuf[0];
+    uint64_t ticks;
+    uint64_t pticks;
+    uint     xfers;
+    uint     rate_alone;
+    uint     rate;
+    uint     loss;
+    int      rc;
+
+    if (g_output == OUTPUT_TEXT) {
+        printf("Probe %u byte random reads with %u KB sequential stream "
+               "on %u TIOs\n", psize, bufsize / 1024, num_tio);
+    }
+
+    rc = run_loaded_phase(tio, buf, bufsize, num_tio, NULL, NULL, psize,
+                          &ticks, &xfers);
+    if (rc != 0)
+        return (rc);
+    rate_alone = calc_kb_per_sec((uint64_t) bufsize * xfers, ticks);
+    result_save("loaded stream alone", bufsize, rate_alone, 1);
+    if (g_output != OUTPUT_TEXT) {
+        print_result("loaded stream alone", bench_offset, bufsize, num_tio,
+                     buf[0], ticks, (uint64_t) bufsize * xfers, xfers, 0);
+    } else {
+        printf("  stream alone        %8u KB/sec\n", rate_alone);
+    }
+
+    rc = run_loaded_phase(tio, buf, bufsize, 0, ptio, pbuf, psize,
+                          &pticks, &xfers);
+    if (rc != 0)
+        return (rc);
+    idle_hist = g_lat_hist;
+    if (g_output != OUTPUT_TEXT) {
+        print_result("loaded probe alone", 0, psize, 1, pbuf, pticks,
+                     (uint64_t) psize * idle_hist.count, idle_hist.count, 0);
+    } else {
+        printf("  probe alone         %8u reads/sec\n",
+               (uint) ((uint64_t) idle_hist.count * g_e_freq /
+                       (pticks ? pticks : 1)));
+        print_lat_hist(&g_lat_hist);
+    }
+
+    rc = run_loaded_phase(tio, buf, bufsize, num_tio, ptio, pbuf, psize,
+                          &ticks, &xfers);
+    rate = calc_kb_per_sec((uint64_t) bufsize * xfers, ticks);
+    result_save("loaded stream", bufsize, rate, 1);
+    if (g_output != OUTPUT_TEXT) {
+        print_result("loaded probe", 0, psize, 1, pbuf, ticks,
+                     (uint64_t) psize * g_lat_hist.count, g_lat_hist.count,
+                     0);
+        lat_hist_clear(&g_lat_hist);
+        print_result("loaded stream", bench_offset, bufsize, num_tio, buf[0],
+                     ticks, (uint64_t) bufsize * xfers, xfers, 0);
+        return (rc);
+    }
+    loss = (rate >= rate_alone) ? 0 :
+           (uint) ((uint64_t) (rate_alone - rate) * 1000 / rate_alone);
+    printf("  stream with probe   %8u KB/sec  (%u.%u%% loss)\n",
+           rate, loss / 10, loss % 10);
+    printf("  probe with stream   %8u reads/sec\n",
+           (uint) ((uint64_t) g_lat_hist.count * g_e_freq /
+                   (ticks ? ticks : 1)));
+    print_lat_hist(&g_lat_hist);
+    if ((idle_hist.count != 0) && (g_lat_hist.count != 0)) {
+        uint idle99 = lat_hist_value(&idle_hist, 990);
+        uint load99 = lat_hist_value(&g_lat_hist, 990);
+        uint x10 = (idle99 == 0) ? 0 :
+                   (uint) ((uint64_t) load99 * 10 / idle99);
+        printf("  probe p99 latency is %u.%ux idle\n", x10 / 10, x10 % 10);
+    }
+    return (rc);
+}
+
+/*
+ * A trace file for -e replay has one request per line:
+ *     <time_us> <R|W> <offset> <length>
+ * where time_us is microseconds from the start of the trace, and offset
+ * and length are in bytes. Numbers may be decimal or hex (0x prefix).
+ * Blank lines and lines starting with # are ignored.
+ */
+typedef struct {
+    uint64_t time;      // EClock ticks from start of trace
+    uint64_t offset;    // Device byte offset
+    uint32_t length;    // Transfer length in bytes
+    uint8_t  is_write;  // Write (otherwise read)
+} trace_rec_t;
+
+/*
+ * trace_parse_line
+ * ----------------
+ * Parse one line of a trace file. The record time is returned in
+ * microseconds; the caller converts it and validates the request
+ * against the device. Returns 1 for a blank or comment line, 0 for a
+ * valid record, and -1 if the line is not a valid record.
+ */
+static int
+trace_parse_line(const char *line, uint64_t *time_us, trace_rec_t *rec)
+{
+    char     tstr[24];
+    char     cstr[4];
+    char     ostr[24];
+    char     lstr[24];
+    uint64_t length;
+    int      pos = 0;
+
+    line += strspn(line, " \t\r\n");
+    if ((*line == '\0') || (*line == '#'))
+        return (1);
+    if ((sscanf(line, "%23s %3s %23s %23s %n",
+                tstr, cstr, ostr, lstr, &pos) != 4) ||
+        (line[pos] != '\0') || (cstr[1] != '\0') ||
+        parse_offset(tstr, time_us) ||
+        parse_offset(ostr, &rec->offset) ||
+        parse_offset(lstr, &length) || (length > 0xffffffff) ||
+        ((toupper((unsigned char) cstr[0]) != 'R') &&
+         (toupper((unsigned char) cstr[0]) != 'W'))) {
+        return (-1);
+    }
+    rec->is_write = (toupper((unsigned char) cstr[0]) == 'W');
+    rec->length = (uint32_t) length;
+    return (0);
+}
+
+/*
+ * trace_load
+ * ----------
+ * Read a trace file into memory, checking that every request is sector
+ * aligned, fits within the transfer buffers and the partition (or whole
+ * device), and only writes when destructive testing is enabled. On
+ * success, exactly *count records were allocated; the caller must free
+ * them with FreeMem(*recs, *count * sizeof (trace_rec_t)).
+ */
+static int
+trace_load(const char *filename, uint32_t bufsize, int do_destructive,
+           trace_rec_t **recs, uint *count)
+{
+    FILE        *fp;
+    trace_rec_t *rec;
+    trace_rec_t  tmp;
+    char         line[128];
+    uint64_t     start;
+    uint64_t     end;
+    uint64_t     time_us;
+    uint         lines = 0;
+    uint         lineno = 0;
+    uint         pos = 0;
+    int          rc = 0;
+
+    dev_range(&start, &end);
+    fp = fopen(filename, "r");
+    if (fp == NULL) {
+        printf("Unable to open trace file %s\n", filename);
+        return (1);
+    }
+    while (fgets(line, sizeof (line), fp) != NULL)
+        if (trace_parse_line(line, &time_us, &tmp) != 1)
+            lines++;
+    if (lines == 0) {
+        printf("Trace file %s is empty\n", filename);
+        fclose(fp);
+        return (1);
+    }
+    *recs = AllocMem(lines * sizeof (trace_rec_t), MEMF_PUBLIC);
+    if (*recs == NULL) {
+        report_allocmem_fail(lines * sizeof (trace_rec_t), MEMTYPE_ANY);
+        fclose(fp);
+        return (1);
+    }
+
+    rewind(fp);
+    while ((pos < lines) && (fgets(line, sizeof (line), fp) != NULL)) {
+        lineno++;
+        rec = *recs + pos;
+        rc = trace_parse_line(line, &time_us, rec);
+        if (rc == 1) {
+            rc = 0;
+            continue;
+        }
+        if (rc != 0) {
+            printf("%s line %u: invalid record\n", filename, lineno);
+            rc = 1;
+            break;
+        }
+        rec->time = time_us * g_e_freq / 1000000;
+        if ((rec->length == 0) || (rec->length > bufsize) ||
+            (rec->length % g_sector_size) ||
+            (rec->offset % g_sector_size) || (rec->offset < start) ||
+            ((end != 0) && (rec->offset + rec->length > end))) {
+            printf("%s line %u: request is not sector aligned, exceeds "
+                   "%u byte buffer, or is outside the partition\n",
+                   filename, lineno, bufsize);
+            rc = 1;
+            break;
+        }
+        if (rec->is_write && !do_destructive) {
+            printf("%s line %u: trace writes to device; -d required\n",
+                   filename, lineno);
+            rc = 1;
+            break;
+        }
+        pos++;
+    }
+    fclose(fp);
+    if ((rc == 0) && (pos != lines)) {
+        printf("Trace file %s changed while loading\n", filename);
+        rc = 1;
+    }
+    if (rc != 0) {
+        FreeMem(*recs, lines * sizeof (trace_rec_t));
+        return (rc);
+    }
+    *count = pos;
+    return (0);
+}
+
+/*
+ * run_replay
+ * ----------
+ * Replay trace records against the device using the TIO ring. Without
+ * timing, requests are issued as fast as possible with up to num_tio
+ * outstanding. With timing, each request is issued at its original time
+ * from the start of the trace (if a TIO is free), sleeping on
+ * timer.device in between; requests issued late are counted. Read and
+ * write throughput and latency are reported separately.
+ */
+static int
+run_replay(struct IOExtTD **tio, uint8_t **buf, uint num_tio,
+           trace_rec_t *recs, uint count, uint timed)
+{
+    static lat_hist_t hist[2];
+    static const char * const names[] = { "replay read", "replay write" };
+    struct MsgPort  *mp = tio[0]->iotd_Req.io_Message.mn_ReplyPort;
+    struct timerequest *treq = NULL;
+    struct EClockVal stime;
+    struct EClockVal now;
+    struct EClockVal itime[MAX_NUM_TIO];
+    trace_rec_t *rec;
+    uint64_t bytes[2] = { 0, 0 };
+    uint64_t lat_total[2] = { 0, 0 };
+    uint64_t elapsed;
+    uint64_t ticks;
+    uint32_t lag;
+    uint32_t lag_max = 0;
+    uint32_t issued = 0;
+    uint8_t  op[MAX_NUM_TIO];
+    uint     done[2] = { 0, 0 };
+    uint     late = 0;
+    uint     next = 0;
+    uint     tbusy = 0;
+    uint     slot;
+    uint     rw;
+    int      failcode;
+    int      rc = 0;
+
+    if (timed && ((treq = eclock_timer_open(mp)) == NULL))
+        return (1);
+    lat_hist_clear(&hist[0]);
+    lat_hist_clear(&hist[1]);
+    ReadEClock(&stime);
+    now = stime;
+
+    while ((next < count) || (issued != 0)) {
+        /* Collect completed requests */
+        for (slot = 0; slot < num_tio; slot++) {
+            if (((issued & BIT(slot)) == 0) ||
+                (CheckIO((struct IORequest *) tio[slot]) == NULL))
+                continue;
+            failcode = tio_wait(tio[slot]);
+            ReadEClock(&now);
+            issued &= ~BIT(slot);
+            rw = op[slot];
+            if (failcode != 0) {
+                print_io_fail(rw ? "  Write" : "  Read",
+                              failcode, U32(tio[slot]->iotd_Req.io_Offset));
+                rc++;
+                next = count;  // Stop issuing
+                continue;
+            }
+            ticks = diff_e_clock(&itime[slot], &now);
+            lat_total[rw] += ticks;
+            lat_hist_add(&hist[rw], ticks);
+            bytes[rw] += tio[slot]->iotd_Req.io_Length;
+            done[rw]++;
+        }
+        if ((next < count) && is_user_abort()) {
+            print_msg("^C abort\n");
+            rc++;
+            next = count;
+        }
+
+        /* Find a free TIO */
+        for (slot = 0; slot < num_tio; slot++)
+            if ((issued & BIT(slot)) == 0)
+                break;
+
+        if ((next < count) && (slot < num_tio)) {
+            rec = &recs[next];
+            ReadEClock(&now);
+            elapsed = diff_e_clock(&stime, &now);
+            if (timed && (elapsed < rec->time)) {
+                /* Sleep until this request is due or an I/O completes */
+                eclock_timer_wait(treq, &tbusy, &stime, rec->time);
+                continue;
+            }
+            if (timed && (elapsed - rec->time > g_e_freq / 1000)) {
+                lag = elapsed - rec->time;
+                late++;
+                if (lag_max < lag)
+                    lag_max = lag;
+            }
+            rw = rec->is_write;
+            op[slot] = rw;
+            tio[slot]->iotd_Req.io_Command = iocmd_for_end(rw ? CMD_WRITE :
+                                                           CMD_READ,
+                                                           rec->offset +
+                                                           rec->length);
+            tio[slot]->iotd_Req.io_Actual  = rec->offset >> 32;
+            tio[slot]->iotd_Req.io_Offset  = (uint32_t) rec->offset;
+            tio[slot]->iotd_Req.io_Data    = buf[slot];
+            tio[slot]->iotd_Req.io_Length  = rec->length;
+            itime[slot] = now;
+            SendIO((struct IORequest *) tio[slot]);
+            issued |= BIT(slot);
+            next++;
+            continue;
+        }
+        /* Nothing can be issued until a request completes */
+        if (issued != 0) {
+            WaitPort(mp);
+            if (treq != NULL)
+                eclock_timer_check(treq, &tbusy);
+        }
+    }
+    ReadEClock(&now);
+    ticks = diff_e_clock(&stime, &now);
+    if (treq != NULL)
+        eclock_timer_close(treq, tbusy);
+
+    if (g_output == OUTPUT_TEXT) {
+        printf("Replayed %u of %u requests in %u.%03u sec (%s), %u IOPS\n",
+               done[0] + done[1], count, (uint) (ticks / g_e_freq),
+               (uint) (ticks % g_e_freq * 1000 / g_e_freq),
+               timed ? "original timing" : "as fast as possible",
+               (uint) ((uint64_t) (done[0] + done[1]) * g_e_freq /
+                       (ticks ? ticks : 1)));
+        if (late != 0)
+            printf("  %u requests issued more than 1 ms late (max %u ms)\n",
+                   late, ticks_to_usec(lag_max) / 1000);
+    }
+    for (rw = 0; rw < 2; rw++) {
+        uint rate = calc_kb_per_sec(bytes[rw], ticks);
+        uint avg = lat_total[rw] / (done[rw] ? done[rw] : 1);
+
+        if (done[rw] == 0)
+            continue;
+        result_save(names[rw], 0, rate, 1);
+        g_lat_hist = hist[rw];
+        if (g_output != OUTPUT_TEXT) {
+            print_result(names[rw], 0, 0, num_tio, buf[0], ticks, bytes[rw],
+                         done[rw], ticks_to_usec(avg));
+            continue;
+        }
+        printf("  %s %8u KB/sec %7u requests  avg ",
+               rw ? "write" : "read ", rate, done[rw]);
+        print_latency(avg, 1, '\n');
+        print_lat_hist(&g_lat_hist);
+    }
+    return (rc);
+}
+
+/*
+ * parse_rate_arg
+ * --------------
+ * Parse the rate test argument: target[,tsize[,seq|random]]
+ * The target is in requests per second, or in bytes per second when
+ * followed by a K or M suffix (for example 2M is 2 MB/sec).
+ */
+static int
+parse_rate_arg(const char *arg, uint *rate, uint *rate_bytes, uint *tsize,
+               uint *is_random)
+{
+    int pos = 0;
+
+    if ((arg == NULL) || (sscanf(arg, "%u%n", rate, &pos) != 1) ||
+        (*rate == 0)) {
+        printf("rate requires a target: -e rate(iops) or -e rate(<n>M)\n");
+        return (1);
+    }
+    arg += pos;
+    *rate_bytes = 0;
+    switch (*arg) {
+        case 'k':
+        case 'K':
+            *rate <<= 10;
+            *rate_bytes = 1;
+            arg++;
+            break;
+        case 'm':
+        case 'M':
+            *rate <<= 20;
+            *rate_bytes = 1;
+            arg++;
+            break;
+    }
+    if (*rate_bytes && ((*arg == 'b') || (*arg == 'B')))
+        arg++;
+    if (*arg == ',') {
+        arg++;
+        if (isdigit((unsigned char) *arg)) {
+            parse_tsize(arg, tsize, &pos);
+            arg += pos;
+            if (*arg == ',')
+                arg++;
+        }
+    }
+    if (*arg == '\0')
+        return (0);
+    if (strncmp(arg, "rand", 4) == 0) {
+        *is_random = 1;
+    } else if (strncmp(arg, "seq", 3) == 0) {
+        *is_random = 0;
+    } else {
+        printf("Invalid access pattern \"%s\" (seq or random)\n", arg);
+        return (1);
+    }
+    return (0);
+}
+
+/*
+ * run_rate
+ * --------
+ * Open-loop read load: requests are issued on an EClock schedule at
+ * iops requests per second, whether or not earlier requests have
+ * completed, with up to num_tio outstanding. A request which is due
+ * while all num_tio requests are outstanding is dropped. Runs for about
+ * one second or the -T duration. Between requests, the task sleeps on
+ * timer.device rather than polling the EClock. Because issue times do
+ * not depend on completions, the reported latency includes queueing
+ * delay in the device, which a closed-loop test hides.
+ */
+static int
+run_rate(struct IOExtTD **tio, uint8_t **buf, uint32_t size, uint num_tio,
+         uint iops, uint is_random)
+{
+    struct MsgPort  *mp = tio[0]->iotd_Req.io_Message.mn_ReplyPort;
+    struct timerequest *treq;
+    struct EClockVal stime;
+    struct EClockVal now;
+    struct EClockVal itime[MAX_NUM_TIO];
+    uint64_t start;
+    uint64_t end;
+    uint64_t blocks;
+    uint64_t pos;
+    uint64_t seq = 0;
+    uint64_t due;
+    uint64_t elapsed;
+    uint64_t lat_total = 0;
+    uint64_t ticks;
+    uint32_t issued = 0;
+    uint32_t lag;
+    uint32_t lag_max = 0;
+    uint     next = 0;
+    uint     xfer_good = 0;
+    uint     dropped = 0;
+    uint     late = 0;
+    uint     stop = 0;
+    uint     warming = (bench_warmup != 0);
+    uint     tbusy = 0;
+    uint     slot;
+    UWORD    cmd;
+    int      failcode;
+    int      rc = 0;
+
+    dev_range(&start, &end);
+    if (end <= start) {
+        print_msg("Device size unknown; can't run rate test\n");
+        return (1);
+    }
+    blocks = (end - start) / size;
+    if (blocks == 0) {
+        print_msg("Device too small for %u byte rate test\n", size);
+        return (1);
+    }
+    treq = eclock_timer_open(mp);
+    if (treq == NULL)
+        return (1);
+    cmd = iocmd_for_end(CMD_READ, end);
+    srand32(RANDOM_SEED_DEFAULT);
+    lat_hist_clear(&g_lat_hist);
+
+    ReadEClock(&stime);
+    now = stime;
+    while ((stop == 0) || (issued != 0)) {
+        /* Collect completed requests */
+        for (slot = 0; slot < num_tio; slot++) {
+            if (((issued & BIT(slot)) == 0) ||
+                (CheckIO((struct IORequest *) tio[slot]) == NULL))
+                continue;
+            failcode = tio_wait(tio[slot]);
+            ReadEClock(&now);
+            issued &= ~BIT(slot);
+            if (failcode != 0) {
+                print_io_fail("  Read", failcode,
+                              U32(tio[slot]->iotd_Req.io_Offset));
+                rc++;
+                stop = 1;
+                continue;
+            }
+            ticks = diff_e_clock(&itime[slot], &now);
+            lat_total += ticks;
+            lat_hist_add(&g_lat_hist, ticks);
+            xfer_good++;
+        }
+        if (stop) {
+            if (issued != 0) {
+                WaitPort(mp);
+                eclock_timer_check(treq, &tbusy);
+            }
+            continue;
+        }
+
+        ReadEClock(&now);
+        due = (uint64_t) next * g_e_freq / iops;
+        elapsed = diff_e_clock(&stime, &now);
+        if (elapsed < due) {
+            /* Sleep until the next request is due or an I/O completes */
+            eclock_timer_wait(treq, &tbusy, &stime, due);
+            continue;
+        }
+
+        if (bench_duration != 0) {
+            int state = timed_check(&warming, &stime, &now);
+            if (state == TIMED_DONE) {
+                stop = 1;
+                continue;
+            }
+            if (state == TIMED_RESTART) {
+                next = 0;
+                xfer_good = 0;
+                dropped = 0;
+                late = 0;
+                lag_max = 0;
+                lat_total = 0;
+                continue;
+            }
+        } else if ((elapsed > g_e_freq) || is_user_abort()) {
+            stop = 1;
+            continue;
+        }
+        next++;
+
+        for (slot = 0; slot < num_tio; slot++)
+            if ((issued & BIT(slot)) == 0)
+                break;
+        if (slot >= num_tio) {
+            dropped++;
+            continue;
+        }
+        if (elapsed - due > g_e_freq / 1000) {
+            lag = elapsed - due;
+            late++;
+            if (lag_max < lag)
+                lag_max = lag;
+        }
+        if (is_random) {
+            pos = (((uint64_t) rand32() << 32) | rand32()) % blocks;
+        } else {
+            pos = seq;
+            if (++seq >= blocks)
+                seq = 0;
+        }
+        pos = start + pos * size;
+        tio[slot]->iotd_Req.io_Command = cmd;
+        tio[slot]->iotd_Req.io_Actual  = pos >> 32;
+        tio[slot]->iotd_Req.io_Offset  = (uint32_t) pos;
+        tio[slot]->iotd_Req.io_Data    = buf[slot];
+        tio[slot]->iotd_Req.io_Length  = size;
+        itime[slot] = now;
+        SendIO((struct IORequest *) tio[slot]);
+        issued |= BIT(slot);
+    }
+    eclock_timer_close(treq, tbusy);
+    ticks = diff_e_clock(&stime, &now);
+    if (ticks == 0)
+        ticks = 1;
+
+    result_save("rate read", size,
+                calc_kb_per_sec((uint64_t) size * xfer_good, ticks), 1);
+    if (g_output != OUTPUT_TEXT) {
+        print_result("rate read", 0, size, num_tio, buf[0], ticks,
+                     (uint64_t) size * xfer_good, xfer_good,
+                     ticks_to_usec(lat_total / (xfer_good ? xfer_good : 1)));
+        return (rc);
+    }
+    printf("rate %u IOPS ", iops);
+    if (size >= 1024)
+        printf("%u KB", size / 1024);
+    else
+        printf("%u byte", size);
+    printf(" %s reads, up to %u outstanding\n",
+           is_random ? "random" : "sequential", num_tio);
+    printf("  achieved %8u KB/sec %7u IOPS  avg ",
+           calc_kb_per_sec((uint64_t) size * xfer_good, ticks),
+           (uint) ((uint64_t) xfer_good * g_e_freq / ticks));
+    print_latency(lat_total / (xfer_good ? xfer_good : 1), 1, '\n');
+    print_lat_hist(&g_lat_hist);
+    if ((dropped != 0) || (late != 0)) {
+        printf("  %u of %u dropped (all busy), %u late by over 1 ms "
+               "(max %u ms)\n", dropped, next, late,
+               ticks_to_usec(lag_max) / 1000);
+    }
+    return (rc);
+}
+
+#define SEEK_POINTS_DEFAULT 32
+#define SEEK_POINTS_MAX     64
+#define SEEK_SAMPLES        16  // Timed reads at each seek distance
+#define SEEK_CHART          40  // Width of seek latency bar chart
+
+/*
+ * log2_fixed
+ * ----------
+ * Return the base 2 logarithm of a non-zero value as 16.16 fixed point.
+ */
+static uint32_t
+log2_fixed(uint64_t value)
+{
+    uint64_t y;
+    uint32_t result;
+    uint32_t bit;
+    uint     msb = 0;
+
+    while ((value >> msb) > 1)
+        msb++;
+    if (msb >= 16)
+        y = value >> (msb - 16);
+    else
+        y = value << (16 - msb);
+    result = msb << 16;
+    for (bit = 1 << 15; bit != 0; bit >>= 1) {
+        y = (y * y) >> 16;
+        if (y >= (2 << 16)) {
+            y >>= 1;
+            result |= bit;
+        }
+    }
+    return (result);
+}
+
+/*
+ * run_seek_profile
+ * ----------------
+ * Measure single sector read latency as a function of seek distance, at
+ * points log-spaced from one sector to nearly the full device. For each
+ * sample, a sector at a random position is read, and then the sector
+ * the seek distance before it is timed. Reading backward keeps the
+ * drive's read-ahead from satisfying the timed read. Each sample also
+ * includes rotational latency, so on spinning media the minimum at
+ * short distances approaches the track-to-track seek time, and the
+ * average rises toward the full-stroke seek time. Flash media shows a
+ * flat profile.
+ */
+static int
+run_seek_profile(struct IOExtTD *tio, uint8_t *buf, uint points)
+{
+    static lat_hist_t hist[SEEK_POINTS_MAX];
+    uint64_t dist[SEEK_POINTS_MAX];
+    struct EClockVal stime;
+    struct EClockVal etime;
+    uint64_t start;
+    uint64_t end;
+    uint64_t sectors;
+    uint64_t max_dist;
+    uint64_t target;
+    uint64_t lo;
+    uint64_t hi;
+    uint64_t pos;
+    uint32_t log_max;
+    uint32_t avg;
+    uint32_t avg_max = 1;
+    uint     count = 0;
+    uint     point;
+    uint     sample;
+    uint     bar;
+    int      failcode;
+    int      rc = 0;
+    UWORD    iocmd;
+
+    dev_range(&start, &end);
+    if (end <= start) {
+        print_msg("Device size unknown; can't run seek profile\n");
+        return (1);
+    }
+    iocmd = iocmd_for_end(CMD_READ, end);
+
+    /*
+     * Leave some room at the longest distance so that the read positions
+     * still vary, and are not satisfied from the drive cache.
+     */
+    sectors = (end - start) / g_sector_size;
+    max_dist = sectors - 1 - sectors / 64;
+    if ((sectors < 4) || (max_dist < 2)) {
+        print_msg("Device too small for seek profile\n");
+        return (1);
+    }
+    log_max = log2_fixed(max_dist);
+    for (point = 0; point < points; point++) {
+        target = (uint64_t) log_max * point / (points - 1);
+        lo = 1;
+        hi = max_dist;
+        while (lo < hi) {
+            uint64_t mid = lo + (hi - lo) / 2;
+            if (log2_fixed(mid) >= target)
+                hi = mid;
+            else
+                lo = mid + 1;
+        }
+        if ((count > 0) && (lo <= dist[count - 1]))
+            lo = dist[count - 1] + 1;
+        if (lo > max_dist)
+            break;
+        dist[count++] = lo;
+    }
+
+    srand32(RANDOM_SEED_DEFAULT);
+    for (point = 0; point < count; point++) {
+        if (g_output == OUTPUT_TEXT) {
+            printf("Distance %u of %u\r", point + 1, count);
+            fflush(stdout);
+        }
+        lat_hist_clear(&hist[point]);
+        for (sample = 0; sample < SEEK_SAMPLES; sample++) {
+            pos = (((uint64_t) rand32() << 32) | rand32()) %
+                  (sectors - dist[point]);
+            pos = start + (pos + dist[point]) * g_sector_size;
+            tio->iotd_Req.io_Command = iocmd;
+            tio->iotd_Req.io_Actual  = pos >> 32;
+            tio->iotd_Req.io_Offset  = (uint32_t) pos;
+            tio->iotd_Req.io_Length  = g_sector_size;
+            tio->iotd_Req.io_Data    = buf;
+            tio->iotd_Req.io_Flags   = 0;
+            failcode = DoIO((struct IORequest *) tio);
+            if (failcode == 0) {
+                pos -= dist[point] * g_sector_size;
+                tio->iotd_Req.io_Actual  = pos >> 32;
+                tio->iotd_Req.io_Offset  = (uint32_t) pos;
+                ReadEClock(&stime);
+                failcode = DoIO((struct IORequest *) tio);
+                ReadEClock(&etime);
+            }
+            if (failcode != 0) {
+                print_io_fail("Read", failcode, U32(tio->iotd_Req.io_Offset));
+                rc++;
+                break;
+            }
+            lat_hist_add(&hist[point], diff_e_clock(&stime, &etime));
+        }
+        if (rc != 0)
+            break;
+        if (is_user_abort()) {
+            print_msg("^C abort\n");
+            rc++;
+            point++;  // This distance completed; keep it
+            break;
+        }
+    }
+    count = point;
+    for (point = 0; point < count; point++) {
+        avg = hist[point].sum / hist[point].count;
+        if (avg_max < avg)
+            avg_max = avg;
+        if (g_output != OUTPUT_TEXT) {
+            g_lat_hist = hist[point];
+            print_result("seek read", dist[point] * g_sector_size,
+                         g_sector_size, 1, buf, hist[point].sum,
+                         (uint64_t) g_sector_size * hist[point].count,
+                         hist[point].count, ticks_to_usec(avg));
+        }
+    }
+    if ((count == 0) || (g_output != OUTPUT_TEXT))
+        return (rc);
+
+    printf("Seek profile: %u byte reads, %u per distance\n",
+           g_sector_size, SEEK_SAMPLES);
+    printf("     Sectors  Distance   Avg ms   Min ms   Max ms\n");
+    for (point = 0; point < count; point++) {
+        uint64_t bytes = dist[point] * g_sector_size;
+        uint     usec[3];
+        uint     col;
+
+        avg = hist[point].sum / hist[point].count;
+        usec[0] = ticks_to_usec(avg);
+        usec[1] = ticks_to_usec(hist[point].min);
+        usec[2] = ticks_to_usec(hist[point].max);
+        printf("%12s ", llu_to_str(dist[point]));
+        if (bytes < (1 << 10))
+            printf("%6u B ", (uint) bytes);
+        else if (bytes < (1 << 20))
+            printf("%6u KB", (uint) (bytes >> 10));
+        else if (bytes < (1ULL << 30))
+            printf("%6u MB", (uint) (bytes >> 20));
+        else
+            printf("%6u GB", (uint) (bytes >> 30));
+        for (col = 0; col < 3; col++)
+            printf(" %4u.%03u", usec[col] / 1000, usec[col] % 1000);
+        printf("  ");
+        for (bar = avg * SEEK_CHART / avg_max; bar > 0; bar--)
+            printf("*");
+        printf("\n");
+    }
+    return (rc);
+}
+
+#define RPM_SAMPLES    16    // Timed reads in each rotation measurement
+#define RPM_MIN_PERIOD 2000  // Periods below this (usec) are not rotation
+#define RPM_SEARCH     6     // Steps to search for command overhead
+
+/*
+ * rpm_read
+ * --------
+ * Read one sector at the specified device offset. If scmd is not NULL,
+ * the read is issued by HD_SCSICMD as READ(10) with Force Unit Access,
+ * so that the drive must read the sector from media. A drive which
+ * rejects the command with a SCSI status has not read the media, so
+ * that is reported as HFERR_BadStatus.
+ */
+static int
+rpm_read(struct IOExtTD *tio, struct SCSICmd *scmd, uint8_t *buf,
+         uint64_t pos, UWORD iocmd)
+{
+    scsi_generic_t cmd;
+    uint32_t lba;
+    int      rc;
+
+    if (scmd == NULL) {
+        tio->iotd_Req.io_Command = iocmd;
+        tio->iotd_Req.io_Actual  = pos >> 32;
+        tio->iotd_Req.io_Offset  = (uint32_t) pos;
+        tio->iotd_Req.io_Length  = g_sector_size;
+        tio->iotd_Req.io_Data    = buf;
+        tio->iotd_Req.io_Flags   = 0;
+        return (DoIO((struct IORequest *) tio));
+    }
+    lba = pos / g_sector_size;
+    memset(&cmd, 0, sizeof (cmd));
+    cmd.opcode   = SCSI_READ_10_COMMAND;
+    cmd.bytes[0] = SCSI_RW_10_FUA;
+    cmd.bytes[1] = lba >> 24;
+    cmd.bytes[2] = lba >> 16;
+    cmd.bytes[3] = lba >> 8;
+    cmd.bytes[4] = lba;
+    cmd.bytes[7] = 1;  // Transfer length (blocks)
+    setup_scsidirect_cmd(scmd, &cmd, 10, buf, g_sector_size);
+    tio->iotd_Req.io_Command = HD_SCSICMD;
+    tio->iotd_Req.io_Length  = sizeof (*scmd);
+    tio->iotd_Req.io_Data    = scmd;
+    tio->iotd_Req.io_Flags   = 0;
+    rc = DoIO((struct IORequest *) tio);
+    if ((rc == 0) && (scmd->scsi_Status != 0))
+        rc = HFERR_BadStatus;
+    return (rc);
+}
+
+/*
+ * rpm_measure
+ * -----------
+ * Time RPM_SAMPLES single sector reads, each issued delay ticks after
+ * the previous read completed. With step of 0, the same sector is read
+ * every time. A step of -1 reads the sectors before pos in descending
+ * order. Either way, each read which goes to the media has just missed
+ * its sector, so the time from one completion to the next is about one
+ * revolution, as long as the delay plus command overhead is less than
+ * a revolution. The median interval is returned.
+ */
+static int
+rpm_measure(struct IOExtTD *tio, struct SCSICmd *scmd, uint8_t *buf,
+            uint64_t pos, int step, UWORD iocmd, uint32_t delay,
+            uint32_t *median)
+{
+    struct EClockVal ltime;
+    struct EClockVal etime;
+    int failcode;
+    int iter;
+
+    lat_hist_clear(&g_lat_hist);
+    failcode = rpm_read(tio, scmd, buf, pos, iocmd);  // Position the head
+    ReadEClock(&ltime);
+    for (iter = 0; (failcode == 0) && (iter < RPM_SAMPLES); iter++) {
+        do {
+            ReadEClock(&etime);
+        } while (diff_e_clock(&ltime, &etime) < delay);
+        pos += step * (int) g_sector_size;
+        failcode = rpm_read(tio, scmd, buf, pos, iocmd);
+        ReadEClock(&etime);
+        lat_hist_add(&g_lat_hist, diff_e_clock(&ltime, &etime));
+        ltime = etime;
+    }
+    *median = lat_hist_value(&g_lat_hist, 500);
+    return (failcode);
+}
+
+/*
+ * run_rpm
+ * -------
+ * Estimate the rotation period of spinning media from the interval
+ * between back to back reads which each just miss their sector. If the
+ * device accepts HD_SCSICMD, the same sector is read repeatedly with
+ * Force Unit Access. Otherwise, sectors are read in descending order,
+ * which the drive's read-ahead will not satisfy.
+ *
+ * Media rotation is confirmed by repeating the measurement with a host
+ * delay of half the interval between reads. On rotating media, the
+ * interval does not change, while on flash media or from the drive
+ * cache, it grows by the delay. The delay is then increased until reads
+ * start missing an extra revolution; the revolution less that delay is
+ * the command overhead. Random single sector reads give the typical
+ * read latency, which is split into command overhead, average
+ * rotational latency (half a revolution), and the remainder (mostly
+ * seek time).
+ */
+static int
+run_rpm(struct IOExtTD *tio, uint8_t *buf)
+{
+    static const char * const names[] = {
+        "rotation period", "command overhead", "random read"
+    };
+    struct SCSICmd *scmd;
+    struct EClockVal stime;
+    struct EClockVal etime;
+    uint64_t start;
+    uint64_t end;
+    uint64_t sectors;
+    uint64_t pos;
+    uint64_t sum = 0;
+    uint32_t ticks[3];  // Rotation period, command overhead, random read
+    uint32_t usec[3];
+    uint32_t delayed;
+    uint32_t interval;
+    uint32_t lo;
+    uint32_t hi;
+    uint32_t mid;
+    uint32_t other;
+    uint     iter;
+    uint     use_fua = 1;
+    int      step;
+    int      failcode;
+    int      rc = 0;
+    UWORD    iocmd;
+
+    dev_range(&start, &end);
+    sectors = (end - start) / g_sector_size;
+    if ((end <= start) || (sectors < RPM_SAMPLES * RPM_SEARCH * 4)) {
+        print_msg("Device size unknown or too small; can't estimate RPM\n");
+        return (1);
+    }
+    iocmd = iocmd_for_end(CMD_READ, end);
+    pos = start + (sectors / 2) * g_sector_size;
+
+    scmd = AllocMemType(sizeof (*scmd), memtype);
+    if (scmd == NULL) {
+        report_allocmem_fail(sizeof (*scmd), memtype);
+        return (1);
+    }
+    /* SCSI READ(10) only addresses the first 2 TB */
+    if ((((pos + g_sector_size) / g_sector_size) >> 32) ||
+        (rpm_read(tio, scmd, buf, pos, iocmd) != 0)) {
+        FreeMemType(scmd, sizeof (*scmd));
+        scmd = NULL;
+        use_fua = 0;
+    }
+    step = use_fua ? 0 : -1;
+
+    failcode = rpm_measure(tio, scmd, buf, pos, step, iocmd, 0, &ticks[0]);
+    pos += step * RPM_SAMPLES * (int) g_sector_size;
+    if (failcode == 0) {
+        failcode = rpm_measure(tio, scmd, buf, pos, step, iocmd,
+                               ticks[0] / 2, &delayed);
+        pos += step * RPM_SAMPLES * (int) g_sector_size;
+    }
+
+    /* Find the longest delay which does not cost another revolution */
+    lo = 0;
+    hi = ticks[0];
+    for (iter = 0; (failcode == 0) && (iter < RPM_SEARCH); iter++) {
+        mid = (lo + hi) / 2;
+        failcode = rpm_measure(tio, scmd, buf, pos, step, iocmd, mid,
+                               &interval);
+        pos += step * RPM_SAMPLES * (int) g_sector_size;
+        if (interval < ticks[0] + ticks[0] / 2)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    ticks[1] = ticks[0] - lo;
+
+    if (failcode == 0) {
+        srand32(RANDOM_SEED_DEFAULT);
+        for (iter = 0; iter < RPM_SAMPLES; iter++) {
+            pos = start + ((((uint64_t) rand32() << 32) | rand32()) %
+                           sectors) * g_sector_size;
+            ReadEClock(&stime);
+            failcode = rpm_read(tio, NULL, buf, pos, iocmd);
+            ReadEClock(&etime);
+            if (failcode != 0)
+                break;
+            sum += diff_e_clock(&stime, &etime);
+        }
+        ticks[2] = sum / RPM_SAMPLES;
+    }
+    if (scmd != NULL)
+        FreeMemType(scmd, sizeof (*scmd));
+    if (failcode != 0) {
+        printf("Read ");
+        print_fail_nl(failcode);
+        return (1);
+    }
+
+    for (iter = 0; iter < 3; iter++)
+        usec[iter] = ticks_to_usec(ticks[iter]);
+    if ((usec[0] < RPM_MIN_PERIOD) || (delayed > ticks[0] + ticks[0] / 4)) {
+        if (g_output == OUTPUT_TEXT) {
+            printf("Read interval %u.%03u ms follows host delay: drive "
+                   "cache satisfied the reads,\nor media is not spinning\n",
+                   usec[0] / 1000, usec[0] % 1000);
+        }
+        return (rc);
+    }
+    for (iter = 0; iter < 3; iter++) {
+        result_save(names[iter], g_sector_size, usec[iter], 0);
+        if (g_output != OUTPUT_TEXT) {
+            lat_hist_clear(&g_lat_hist);
+            print_result(names[iter], 0, g_sector_size, 1, buf,
+                         ticks[iter], g_sector_size, 1, usec[iter]);
+        }
+    }
+    if (g_output != OUTPUT_TEXT)
+        return (rc);
+
+    printf("Rotation: %u byte reads, %s\n", g_sector_size,
+           use_fua ? "same sector with SCSI Force Unit Access" :
+                     "descending sectors");
+    printf("  revolution %u.%03u ms, %u RPM, average rotational latency "
+           "%u.%03u ms\n", usec[0] / 1000, usec[0] % 1000,
+           (uint) (60ULL * g_e_freq / ticks[0]),
+           usec[0] / 2000, usec[0] / 2 % 1000);
+    printf("  command overhead %u.%03u ms\n", usec[1] / 1000, usec[1] % 1000);
+    if (usec[2] == 0)
+        usec[2] = 1;
+    other = usec[2] - usec[1] - usec[0] / 2;
+    if (usec[1] + usec[0] / 2 > usec[2])
+        other = 0;
+    printf("  random read %u.%03u ms: %u%% rotation, %u%% command overhead, "
+           "%u%% seek\n", usec[2] / 1000, usec[2] % 1000,
+           usec[0] / 2 * 100 / usec[2], usec[1] * 100 / usec[2],
+           other * 100 / usec[2]);
+    return (rc);
+}
+
+#define CACHE_SET_MIN     (32 << 10)  // Smallest cache working set
+#define CACHE_SET_DEFAULT (16 << 20)  // Default largest cache working set
+#define CACHE_SET_MAX     (1U << 30)  // Largest allowed cache working set
+#define CACHE_SAMPLES     64          // Timed reads per working set
+#define CACHE_STEPS       24          // Maximum working sets or strides
+#define READAHEAD_READS   16          // Timed reads per read-ahead stride
+#define READAHEAD_MAX     (1 << 20)   // Largest read-ahead stride
+
+/*
+ * cache_read
+ * ----------
+ * Time a single sector read at the specified device offset.
+ */
+static int
+cache_read(struct IOExtTD *tio, uint8_t *buf, uint64_t pos, UWORD iocmd,
+           uint32_t *ticks)
+{
+    struct EClockVal stime;
+    struct EClockVal etime;
+    int failcode;
+
+    tio->iotd_Req.io_Command = iocmd;
+    tio->iotd_Req.io_Actual  = pos >> 32;
+    tio->iotd_Req.io_Offset  = (uint32_t) pos;
+    tio->iotd_Req.io_Length  = g_sector_size;
+    tio->iotd_Req.io_Data    = buf;
+    tio->iotd_Req.io_Flags   = 0;
+    ReadEClock(&stime);
+    failcode = DoIO((struct IORequest *) tio);
+    ReadEClock(&etime);
+    *ticks = diff_e_clock(&stime, &etime);
+    if (failcode != 0) {
+        print_io_fail("Read", failcode, U32(tio->iotd_Req.io_Offset));
+    }
+    return (failcode);
+}
+
+/*
+ * print_cache_buffers
+ * -------------------
+ * Compare the BUFFERS setting of the partition under test with the
+ * detected drive read cache size. Filesystem buffers which fit within
+ * the drive cache only hold what the drive would return quickly anyway.
+ * If open_ended is set, the cache may be larger than cache_size.
+ */
+static void
+print_cache_buffers(uint32_t cache_size, uint open_ended)
+{
+    uint64_t bytes;
+
+    if (g_envec == NULL) {
+        printf("No partition DosEnvec; specify a partition (such as DH0:) "
+               "to compare its BUFFERS\n");
+        return;
+    }
+    if (g_envec->de_TableSize < DE_NUMBUFFERS) {
+        printf("Partition DosEnvec has no BUFFERS setting\n");
+        return;
+    }
+    bytes = (uint64_t) g_envec->de_NumBuffers * g_envec->de_SizeBlock * 4;
+    printf("Partition BUFFERS=%u (%u KB) ", U32(g_envec->de_NumBuffers),
+           (uint) (bytes >> 10));
+    if (cache_size == 0)
+        printf("do not overlap a drive read cache\n");
+    else if (bytes <= cache_size)
+        printf("fit within the drive read cache (redundant)\n");
+    else if (open_ended)
+        printf("may fit within the drive read cache (redundant)\n");
+    else
+        printf("go %u KB beyond the drive read cache\n",
+               (uint) ((bytes - cache_size) >> 10));
+}
+
+/*
+ * run_cache_detect
+ * ----------------
+ * Characterise the drive read cache. First, working sets of increasing
+ * size are read sequentially, then sampled with random single sector
+ * reads. While the working set fits in the drive cache, the reads are
+ * satisfied from the cache; above that, a growing fraction go to the
+ * media. A set is fast only while its 90th percentile latency is, so
+ * at least 90% of its reads hit; the median would stay fast up to twice
+ * the cache size. The cache size is then estimated as between 90% of
+ * the largest fast set and the next set size.
+ *
+ * Second, single sector reads are issued in ascending order at strides
+ * of increasing size, in areas not yet read. While the stride is within
+ * the drive's read-ahead, the reads hit the cache. The largest fast
+ * stride is the read-ahead depth.
+ */
+static int
+run_cache_detect(struct IOExtTD *tio, uint8_t *buf, uint32_t bufsize,
+                 uint32_t max_set)
+{
+    uint32_t set_size[CACHE_STEPS];
+    uint32_t set_lat[CACHE_STEPS];
+    uint32_t stride_lat[CACHE_STEPS];
+    uint64_t start;
+    uint64_t end;
+    uint64_t pos;
+    uint64_t ra_pos;
+    uint32_t size;
+    uint32_t stride;
+    uint32_t ticks;
+    uint32_t fast;
+    uint32_t cache_size = 0;
+    uint32_t ra_depth = 0;
+    uint     sets = 0;
+    uint     strides = 0;
+    uint     cur;
+    uint     iter;
+    int      rc = 0;
+    UWORD    iocmd;
+
+    dev_range(&start, &end);
+    if (start < bench_offset)
+        start = bench_offset;
+    if ((end <= start) ||
+        (end - start < (uint64_t) max_set * 2 + READAHEAD_MAX * 2)) {
+        print_msg("Device too small for %u KB cache test\n", max_set >> 10);
+        return (1);
+    }
+    if (bufsize > CACHE_SET_MIN)
+        bufsize = CACHE_SET_MIN;
+    iocmd = iocmd_for_end(CMD_READ, end);
+    srand32(RANDOM_SEED_DEFAULT);
+
+    if (max_set > CACHE_SET_MAX)
+        max_set = CACHE_SET_MAX;
+    for (size = CACHE_SET_MIN; sets < CACHE_STEPS; size <<= 1) {
+        if (g_output == OUTPUT_TEXT) {
+            printf("Working set %u KB\r", size >> 10);
+            fflush(stdout);
+        }
+        /* Read the working set into the drive cache */
+        for (pos = 0; (rc == 0) && (pos < size); pos += bufsize) {
+            tio->iotd_Req.io_Command = iocmd;
+            tio->iotd_Req.io_Actual  = (start + pos) >> 32;
+            tio->iotd_Req.io_Offset  = (uint32_t) (start + pos);
+            tio->iotd_Req.io_Length  = bufsize;
+            tio->iotd_Req.io_Data    = buf;
+            tio->iotd_Req.io_Flags   = 0;
+            rc = DoIO((struct IORequest *) tio);
+        }
+        if (rc != 0) {
+            printf("Read ");
+            print_fail_nl(rc);
+            return (1);
+        }
+        lat_hist_clear(&g_lat_hist);
+        for (iter = 0; iter < CACHE_SAMPLES; iter++) {
+            pos = start + (rand32() % (size / g_sector_size)) * g_sector_size;
+            if (cache_read(tio, buf, pos, iocmd, &ticks) != 0)
+                return (1);
+            lat_hist_add(&g_lat_hist, ticks);
+        }
+        set_size[sets] = size;
+        set_lat[sets] = lat_hist_value(&g_lat_hist, 900);
+        if (g_output != OUTPUT_TEXT)
+            print_result("cache working set", size, g_sector_size, 1, buf,
+                         g_lat_hist.sum, (uint64_t) g_sector_size *
+                         CACHE_SAMPLES, CACHE_SAMPLES, 0);
+        sets++;
+        if (is_user_abort()) {
+            print_msg("^C abort\n");
+            return (1);
+        }
+        if (size > max_set / 2)
+            break;  // Next size exceeds max_set (and may overflow)
+    }
+
+    /* Read-ahead areas follow the largest working set */
+    ra_pos = start + (uint64_t) max_set * 2;
+    for (stride = g_sector_size;
+         (stride <= READAHEAD_MAX) && (strides < CACHE_STEPS); stride <<= 1) {
+        if (ra_pos + (uint64_t) stride * READAHEAD_READS > end)
+            break;
+        if (g_output == OUTPUT_TEXT) {
+            printf("Read-ahead stride %u bytes\r", stride);
+            fflush(stdout);
+        }
+        lat_hist_clear(&g_lat_hist);
+        for (iter = 0; iter < READAHEAD_READS; iter++) {
+            if (cache_read(tio, buf, ra_pos, iocmd, &ticks) != 0)
+                return (1);
+            if (iter > 0)  // The first read positions the stream
+                lat_hist_add(&g_lat_hist, ticks);
+            ra_pos += stride;
+        }
+        ra_pos += READAHEAD_MAX;  // Skip past anything read ahead
+        stride_lat[strides] = lat_hist_value(&g_lat_hist, 500);
+        if (g_output != OUTPUT_TEXT)
+            print_result("cache read-ahead stride", stride, g_sector_size, 1,
+                         buf, g_lat_hist.sum, (uint64_t) g_sector_size *
+                         (READAHEAD_READS - 1), READAHEAD_READS - 1, 0);
+        strides++;
+    }
+    if ((sets < 2) || (g_output != OUTPUT_TEXT))
+        return (rc);
+
+    /*
+     * A read is fast if nearer the smallest set latency than the largest.
+     * The cache size and read-ahead depth are where the fast reads end.
+     */
+    fast = (set_lat[0] + set_lat[sets - 1]) / 2;
+    for (cur = 0; (cur < sets) && (set_lat[cur] <= fast); cur++)
+        cache_size = set_size[cur];
+    for (cur = 0; (cur < strides) && (stride_lat[cur] <= fast); cur++)
+        ra_depth = g_sector_size << cur;
+
+    printf("Working set      P90 ms      Stride   Median ms\n");
+    for (cur = 0; (cur < sets) || (cur < strides); cur++) {
+        if (cur < sets) {
+            ticks = ticks_to_usec(set_lat[cur]);
+            printf("%8u KB %7u.%03u %c", set_size[cur] >> 10,
+                   ticks / 1000, ticks % 1000,
+                   (set_lat[cur] <= fast) ? '*' : ' ');
+        } else {
+            printf("%25s", "");
+        }
+        if (cur < strides) {
+            stride = g_sector_size << cur;
+            ticks = ticks_to_usec(stride_lat[cur]);
+            printf("  %7u %s %7u.%03u %c", (stride < 1024) ? stride :
+                   stride >> 10, (stride < 1024) ? "B " : "KB",
+                   ticks / 1000, ticks % 1000,
+                   (stride_lat[cur] <= fast) ? '*' : ' ');
+        }
+        printf("\n");
+    }
+    if (set_lat[sets - 1] < set_lat[0] * 2) {
+        printf("No drive read cache effect detected\n");
+        print_cache_buffers(0, 0);
+        return (rc);
+    }
+    printf("* = cache hit.  Drive read cache estimate %u",
+           cache_size / 10 * 9 >> 10);
+    if (cache_size == set_size[sets - 1])
+        printf(" KB or more");
+    else
+        printf(" to %u KB", (cache_size >> 10) * 2);
+    if (ra_depth != 0)
+        printf(", read-ahead about %u KB", ra_depth >> 10);
+    else
+        printf(", no read-ahead detected");
+    printf("\n");
+    print_cache_buffers(cache_size, cache_size == set_size[sets - 1]);
+    return (rc);
+}
+
+#define WCACHE_WRITES     32        // Timed writes in each measurement
+#define WCACHE_SIZE       4096      // Default write size
+#define CACHING_PAGE      0x08      // SCSI Caching mode page
+#define CACHING_PAGE_WCE  0x04      // Write cache enable
+#define CACHING_PAGE_RCD  0x01      // Read cache disable
+
+/*
+ * scsi_caching_page
+ * -----------------
+ * Return byte 2 of the SCSI Caching mode page, which holds the WCE and
+ * RCD bits, or -1 if the device did not report the page.
+ */
+static int
+scsi_caching_page(struct IOExtTD *tio)
+{
+    uint8_t *pages;
+    uint     pos;
+    int      flags = -1;
+
+    if (scsi_read_mode_pages(tio, &pages) != 0)
+        return (-1);
+    for (pos = 4; pos + 2 < pages[0]; pos += pages[pos + 1] + 2) {
+        if ((pages[pos] & DISK_PGCODE) == CACHING_PAGE) {
+            flags = pages[pos + 2];
+            break;
+        }
+    }
+    FreeMemType(pages, SCSI_MODE_PAGES_BUFSIZE);
+    return (flags);
+}
+
+/*
+ * wcache_flush
+ * ------------
+ * Ask the device to write its cache to media, by SCSI SYNCHRONIZE CACHE
+ * in scmd if it is not NULL, otherwise by CMD_UPDATE. A SCSI status such
+ * as CHECK CONDITION means the drive did not flush, so it is reported
+ * as HFERR_BadStatus even if the driver returned success.
+ */
+static int
+wcache_flush(struct IOExtTD *tio, struct SCSICmd *scmd)
+{
+    scsi_generic_t cmd;
+    int            rc;
+
+    if (scmd != NULL) {
+        memset(&cmd, 0, sizeof (cmd));
+        cmd.opcode = SYNCHRONIZE_CACHE_10;
+        setup_scsidirect_cmd(scmd, &cmd, 10, NULL, 0);
+        tio->iotd_Req.io_Command = HD_SCSICMD;
+        tio->iotd_Req.io_Length  = sizeof (*scmd);
+        tio->iotd_Req.io_Data    = scmd;
+        tio->iotd_Req.io_Flags   = 0;
+        rc = DoIO((struct IORequest *) tio);
+        if ((rc == 0) && (scmd->scsi_Status != 0))
+            rc = HFERR_BadStatus;
+        return (rc);
+    }
+    tio->iotd_Req.io_Command = CMD_UPDATE;
+    tio->iotd_Req.io_Actual  = 0;
+    tio->iotd_Req.io_Offset  = 0;
+    tio->iotd_Req.io_Length  = 0;
+    tio->iotd_Req.io_Data    = NULL;
+    tio->iotd_Req.io_Flags   = 0;
+    return (DoIO((struct IORequest *) tio));
+}
+
+/*
+ * run_wcache
+ * ----------
+ * Determine whether writes are acknowledged from a volatile drive
+ * cache. The SCSI Caching mode page is read to report the WCE and RCD
+ * bits. Then sequential writes are timed alone, and each followed by a
+ * flush (SCSI SYNCHRONIZE CACHE, or CMD_UPDATE if the driver or drive
+ * rejects it). If a flush takes longer than the write before it,
+ * the write was only in the drive cache. A fast CMD_UPDATE proves
+ * nothing, as many drivers do not pass it to the drive. The durable
+ * write rate is the throughput when every write is flushed.
+ */
+static int
+run_wcache(struct IOExtTD *tio, uint8_t *buf, uint32_t size)
+{
+    static lat_hist_t hist[3];
+    static const char * const names[] = {
+        "wcache write", "wcache flush", "wcache durable write"
+    };
+    static const char * const labels[] = {
+        "write", "flush", "write + flush"
+    };
+    struct EClockVal stime;
+    struct EClockVal mtime;
+    struct EClockVal etime;
+    struct SCSICmd *scmd;
+    uint64_t start;
+    uint64_t end;
+    uint64_t pos;
+    uint64_t total[3] = { 0, 0, 0 };
+    uint32_t median[3];
+    uint     use_scsi;
+    uint     flush;
+    uint     iter;
+    uint     cur;
+    int      caching;
+    int      failcode = 0;
+    UWORD    iocmd;
+
+    dev_range(&start, &end);
+    if (start < bench_offset)
+        start = bench_offset;
+    if ((end <= start) || (end - start < (uint64_t) size * WCACHE_WRITES)) {
+        print_msg("Device too small for write cache test\n");
+        return (1);
+    }
+    iocmd = iocmd_for_end(CMD_WRITE, end);
+
+    scmd = AllocMemType(sizeof (*scmd), memtype);
+    if (scmd == NULL) {
+        report_allocmem_fail(sizeof (*scmd), memtype);
+        return (1);
+    }
+    caching = scsi_caching_page(tio);
+    if (wcache_flush(tio, scmd) != 0) {
+        FreeMemType(scmd, sizeof (*scmd));
+        scmd = NULL;
+        if (wcache_flush(tio, NULL) != 0) {
+            printf("Device supports neither SYNCHRONIZE CACHE nor "
+                   "CMD_UPDATE\n");
+            return (1);
+        }
+    }
+    use_scsi = (scmd != NULL);
+    for (cur = 0; cur < 3; cur++)
+        lat_hist_clear(&hist[cur]);
+
+    for (flush = 0; (flush < 2) && (failcode == 0); flush++) {
+        pos = start;
+        for (iter = 0; iter < WCACHE_WRITES; iter++, pos += size) {
+            tio->iotd_Req.io_Command = iocmd;
+            tio->iotd_Req.io_Actual  = pos >> 32;
+            tio->iotd_Req.io_Offset  = (uint32_t) pos;
+            tio->iotd_Req.io_Length  = size;
+            tio->iotd_Req.io_Data    = buf;
+            tio->iotd_Req.io_Flags   = 0;
+            ReadEClock(&stime);
+            failcode = DoIO((struct IORequest *) tio);
+            ReadEClock(&mtime);
+            if ((failcode == 0) && flush)
+                failcode = wcache_flush(tio, scmd);
+            ReadEClock(&etime);
+            if (failcode != 0) {
+                print_io_fail(flush ? "Write + flush" : "Write",
+                              failcode, U32(pos));
+                break;
+            }
+            if (flush == 0) {
+                lat_hist_add(&hist[0], diff_e_clock(&stime, &mtime));
+                total[0] += diff_e_clock(&stime, &mtime);
+            } else {
+                lat_hist_add(&hist[1], diff_e_clock(&mtime, &etime));
+                lat_hist_add(&hist[2], diff_e_clock(&stime, &etime));
+                total[1] += diff_e_clock(&mtime, &etime);
+                total[2] += diff_e_clock(&stime, &etime);
+            }
+        }
+        /* Leave nothing in the cache before the next measurement */
+        if ((failcode == 0) && (flush == 0))
+            failcode = wcache_flush(tio, scmd);
+    }
+    if (scmd != NULL)
+        FreeMemType(scmd, sizeof (*scmd));
+    if (failcode != 0)
+        return (1);
+
+    for (cur = 0; cur < 3; cur++) {
+        median[cur] = lat_hist_value(&hist[cur], 500);
+        if (cur != 1)
+            result_save(names[cur], size,
+                        calc_kb_per_sec((uint64_t) size * WCACHE_WRITES,
+                                        total[cur]), 1);
+        if (g_output != OUTPUT_TEXT) {
+            g_lat_hist = hist[cur];
+            print_result(names[cur], start, (cur == 1) ? 0 : size, 1, buf,
+                         total[cur], (cur == 1) ? 0 :
+                         (uint64_t) size * WCACHE_WRITES, WCACHE_WRITES, 0);
+        }
+    }
+    if (g_output != OUTPUT_TEXT)
+        return (0);
+
+    printf("Caching mode page: ");
+    if (caching < 0) {
+        printf("not available\n");
+    } else {
+        printf("WCE=%u (write cache %s), RCD=%u (read cache %s)\n",
+               !!(caching & CACHING_PAGE_WCE),
+               (caching & CACHING_PAGE_WCE) ? "on" : "off",
+               !!(caching & CACHING_PAGE_RCD),
+               (caching & CACHING_PAGE_RCD) ? "off" : "on");
+    }
+    printf("%u ", WCACHE_WRITES);
+    if (size >= 1024)
+        printf("%u KB", size / 1024);
+    else
+        printf("%u byte", size);
+    printf(" writes, flush by %s\n",
+           use_scsi ? "SYNCHRONIZE CACHE" : "CMD_UPDATE");
+    printf("                Median      Rate\n");
+    for (cur = 0; cur < 3; cur++) {
+        uint usec = ticks_to_usec(median[cur]);
+        printf("  %-13s %3u.%03u ms", labels[cur], usec / 1000, usec % 1000);
+        if (cur != 1)
+            printf(" %5u KB/sec",
+                   calc_kb_per_sec((uint64_t) size * WCACHE_WRITES,
+                                   total[cur]));
+        printf("%s\n", (cur == 2) ? " durable" : "");
+    }
+    if (median[1] > median[0])
+        printf("Writes are acknowledged from the drive's volatile cache\n");
+    else if (use_scsi == 0)
+        printf("Inconclusive: CMD_UPDATE may not flush the drive cache\n");
+    else
+        printf("Writes appear to reach media before completing\n");
+    return (0);
+}
+
+#define REORDER_BATCHES 8   // Batches timed in each issue mode
+#define REORDER_TIO     16  // Default reads in a batch
+
+/*
+ * reorder_batch
+ * -------------
+ * Read one sector at each of the n positions, in the order given. If
+ * parallel is set, all reads are issued at once; otherwise each is
+ * issued when the previous completes. Replies are taken from the port
+ * with GetMsg(), which returns them in completion order. Each reply
+ * adds one inversion for every request issued before it which is still
+ * outstanding. The batch time, the sum of request latencies, and the
+ * inversion count are added to the totals.
+ */
+static int
+reorder_batch(struct IOExtTD **tio, uint8_t **buf, uint n, uint64_t *pos,
+              UWORD iocmd, uint parallel, uint64_t *ticks, uint64_t *lat_sum,
+              uint *inversions)
+{
+    struct MsgPort  *mp = tio[0]->iotd_Req.io_Message.mn_ReplyPort;
+    struct Message  *msg;
+    struct EClockVal stime;
+    struct EClockVal etime;
+    struct EClockVal itime[MAX_NUM_TIO];
+    uint32_t issued = 0;
+    uint     next = 0;
+    uint     done = 0;
+    uint     slot;
+    uint     prev;
+    int      failcode;
+    int      rc = 0;
+
+    ReadEClock(&stime);
+    while (done < n) {
+        while ((next < n) && (parallel || (issued == 0))) {
+            tio[next]->iotd_Req.io_Command = iocmd;
+            tio[next]->iotd_Req.io_Actual  = pos[next] >> 32;
+            tio[next]->iotd_Req.io_Offset  = (uint32_t) pos[next];
+            tio[next]->iotd_Req.io_Length  = g_sector_size;
+            tio[next]->iotd_Req.io_Data    = buf[next];
+            tio[next]->iotd_Req.io_Flags   = 0;
+            ReadEClock(&itime[next]);
+            SendIO((struct IORequest *) tio[next]);
+            issued |= BIT(next);
+            next++;
+        }
+        WaitPort(mp);
+        while ((msg = GetMsg(mp)) != NULL) {
+            ReadEClock(&etime);
+            for (slot = 0; slot < next; slot++)
+                if (msg == &tio[slot]->iotd_Req.io_Message)
+                    break;
+            if ((slot >= next) || ((issued & BIT(slot)) == 0))
+                continue;  // Not one of ours
+            issued &= ~BIT(slot);
+            failcode = tio[slot]->iotd_Req.io_Error;
+            if (failcode != 0) {
+                print_io_fail("Read", failcode,
+                              U32(tio[slot]->iotd_Req.io_Offset));
+                rc++;
+            }
+            *lat_sum += diff_e_clock(&itime[slot], &etime);
+            for (prev = 0; prev < slot; prev++)
+                if (issued & BIT(prev))
+                    (*inversions)++;
+            done++;
+        }
+    }
+    *ticks += diff_e_clock(&stime, &etime);
+    return (rc);
+}
+
+/*
+ * run_reorder
+ * -----------
+ * Detect whether the driver or drive reorders queued requests (tagged
+ * or native command queuing, or a driver elevator). A batch of single
+ * sector reads scattered across the device is issued in a deliberately
+ * bad seek order, alternating between the lowest and highest remaining
+ * offsets. The batch is timed when issued one at a time, which can not
+ * be reordered, and when issued all at once. The same batch sorted by
+ * offset and issued all at once shows the best case. Each batch uses
+ * new offsets so that the drive cache does not help.
+ */
+static int
+run_reorder(struct IOExtTD **tio, uint8_t **buf, uint num_tio)
+{
+    static const char * const names[] = {
+        "reorder serial", "reorder bad order", "reorder sorted"
+    };
+    static const char * const labels[] = {
+        "bad order, one at a time", "bad order, all at once",
+        "sorted, all at once"
+    };
+    uint64_t pos[MAX_NUM_TIO];
+    uint64_t ticks[3] = { 0, 0, 0 };
+    uint64_t lat_sum[3] = { 0, 0, 0 };
+    uint     inversions[3] = { 0, 0, 0 };
+    uint     pairs;
+    uint64_t start;
+    uint64_t end;
+    uint64_t span;
+    uint64_t jitter;
+    uint     batch;
+    uint     mode;
+    uint     cur;
+    uint     idx;
+    int      rc = 0;
+
+    dev_range(&start, &end);
+    if (num_tio < 4) {
+        printf("Reorder test needs at least 4 requests (-B)\n");
+        return (1);
+    }
+    span = (end > start) ? (end - start) / num_tio : 0;
+    span -= span % g_sector_size;
+    if (span < g_sector_size * REORDER_BATCHES * 3) {
+        print_msg("Device too small for reorder test\n");
+        return (1);
+    }
+
+    srand32(RANDOM_SEED_DEFAULT);
+    for (batch = 0; (batch < REORDER_BATCHES) && (rc == 0); batch++) {
+        for (mode = 0; (mode < 3) && (rc == 0); mode++) {
+            jitter = (((uint64_t) rand32() << 32) | rand32()) %
+                     (span / g_sector_size) * g_sector_size;
+            for (cur = 0; cur < num_tio; cur++) {
+                idx = cur;
+                if (mode != 2)
+                    idx = (cur & 1) ? num_tio - 1 - cur / 2 : cur / 2;
+                pos[cur] = start + span * idx + jitter;
+            }
+            rc = reorder_batch(tio, buf, num_tio, pos,
+                               iocmd_for_end(CMD_READ, end), mode != 0,
+                               &ticks[mode], &lat_sum[mode],
+                               &inversions[mode]);
+        }
+        if (is_user_abort()) {
+            print_msg("^C abort\n");
+            rc++;
+        }
+    }
+    if (rc != 0)
+        return (rc);
+
+    for (mode = 0; mode < 3; mode++) {
+        uint avg = lat_sum[mode] / (num_tio * REORDER_BATCHES);
+
+        result_save(names[mode], g_sector_size, ticks_to_usec(avg), 0);
+        if (g_output != OUTPUT_TEXT) {
+            lat_hist_clear(&g_lat_hist);
+            print_result(names[mode], 0, g_sector_size, num_tio, buf[0],
+                         ticks[mode], (uint64_t) g_sector_size * num_tio *
+                         REORDER_BATCHES, num_tio * REORDER_BATCHES,
+                         ticks_to_usec(avg));
+        }
+    }
+    if (g_output != OUTPUT_TEXT)
+        return (0);
+
+    /* Inversions are out of all pairs of requests in each batch */
+    pairs = num_tio * (num_tio - 1) / 2 * REORDER_BATCHES;
+    printf("Reorder: %u reads of %u bytes across device, %u batches\n",
+           num_tio, g_sector_size, REORDER_BATCHES);
+    printf("                              Batch ms  Avg latency ms  "
+           "  Inversions\n");
+    for (mode = 0; mode < 3; mode++) {
+        uint batch_us = ticks_to_usec(ticks[mode] / REORDER_BATCHES);
+        uint avg_us = ticks_to_usec(lat_sum[mode] /
+                                    (num_tio * REORDER_BATCHES));
+
+        printf("  %-26s %5u.%03u  %10u.%03u  %8u%%\n", labels[mode],
+               batch_us / 1000, batch_us % 1000, avg_us / 1000,
+               avg_us % 1000, inversions[mode] * 100 / pairs);
+    }
+    if (inversions[1] < REORDER_BATCHES) {
+        printf("Requests complete in issue order; no reordering detected\n");
+    } else if (ticks[1] < ticks[0]) {
+        printf("Requests are reordered (TCQ/NCQ or driver elevator): batch "
+               "%u%% faster than\nissue order, %u%% slower than sorted\n",
+               (uint) ((ticks[0] - ticks[1]) * 100 / ticks[0]),
+               (ticks[1] > ticks[2]) ?
+               (uint) ((ticks[1] - ticks[2]) * 100 / ticks[2]) : 0);
+    } else {
+        printf("Requests complete out of order, but no faster than issued "
+               "one at a time\n");
+    }
+    return (0);
+}
+
+#define HEATMAP_SAMPLES 4096   // Default reads across the device
+#define HEATMAP_MAX     65536  // Maximum reads across the device
+#define HEATMAP_ROWS    32     // Device offset buckets
+#define HEATMAP_COLS    14     // Latency buckets, by power of two
+#define HEATMAP_WORST   5      // Slowest reads to report
+
+/*
+ * heatmap_col
+ * -----------
+ * Return the latency bucket for the specified time in microseconds.
+ * The first bucket is below 64 usec, and each after that is twice the
+ * size of the one before.
+ */
+static uint
+heatmap_col(uint usec)
+{
+    uint col = 0;
+
+    for (usec >>= 6; (usec != 0) && (col < HEATMAP_COLS - 1); usec >>= 1)
+        col++;
+    return (col);
+}
+
+/*
+ * run_heatmap
+ * -----------
+ * Time single sector reads at many offsets across the device, using the
+ * average butterfly pattern of latency_butterfly() so that consecutive
+ * reads are far apart, and the drive cache does not help. The results
+ * are shown as a grid of device offset against latency, where each
+ * cell's character shows how many reads fell in it. Slow regions,
+ * remapped sectors, and failing flash blocks stand out from the rest.
+ * The slowest individual reads are also listed.
+ */
+static int
+run_heatmap(struct IOExtTD *tio, uint8_t *buf, uint samples)
+{
+    static const char levels[] = " .:-=+*#%@";
+    static const char * const labels[HEATMAP_COLS] = {
+        "<.06", ".125", ".25", ".5", "1", "2", "4", "8", "16", "32", "64",
+        "128", "256", "more"
+    };
+    static lat_hist_t hist[HEATMAP_ROWS];
+    static uint32_t   grid[HEATMAP_ROWS][HEATMAP_COLS];
+    struct EClockVal stime;
+    struct EClockVal etime;
+    butterfly_t bf;
+    uint64_t start;
+    uint64_t end;
+    uint64_t worst_pos[HEATMAP_WORST];
+    uint32_t worst_ticks[HEATMAP_WORST];
+    uint64_t row_size;
+    uint64_t pos;
+    uint32_t ticks;
+    uint32_t cell_max = 1;
+    uint     iter;
+    uint     row;
+    uint     col;
+    uint     cur;
+    int      failcode;
+    int      rc = 0;
+    UWORD    iocmd;
+
+    dev_range(&start, &end);
+    if ((end <= start) ||
+        (end - start < (uint64_t) g_sector_size * HEATMAP_ROWS * 4)) {
+        print_msg("Device size unknown or too small for heatmap\n");
+        return (1);
+    }
+    iocmd = iocmd_for_end(CMD_READ, end);
+    row_size = (end - start + HEATMAP_ROWS - 1) / HEATMAP_ROWS;
+    butterfly_init(&bf, BUTTERFLY_MODE_AVG, samples, start, end);
+    samples = bf.count;
+
+    memset(grid, 0, sizeof (grid));
+    memset(worst_ticks, 0, sizeof (worst_ticks));
+    for (row = 0; row < HEATMAP_ROWS; row++)
+        lat_hist_clear(&hist[row]);
+
+    for (iter = 0; iter < samples; iter++) {
+        pos = butterfly_pos(&bf, iter);
+        tio->iotd_Req.io_Command = iocmd;
+        tio->iotd_Req.io_Actual  = pos >> 32;
+        tio->iotd_Req.io_Offset  = (uint32_t) pos;
+        tio->iotd_Req.io_Length  = g_sector_size;
+        tio->iotd_Req.io_Data    = buf;
+        tio->iotd_Req.io_Flags   = 0;
+        ReadEClock(&stime);
+        failcode = DoIO((struct IORequest *) tio);
+        ReadEClock(&etime);
+        if (failcode != 0) {
+            print_io_fail("Read", failcode, U32(pos));
+            rc++;
+            break;
+        }
+        ticks = diff_e_clock(&stime, &etime);
+        row = (pos - start) / row_size;
+        col = heatmap_col(ticks_to_usec(ticks));
+        lat_hist_add(&hist[row], ticks);
+        if (cell_max < ++grid[row][col])
+            cell_max = grid[row][col];
+
+        /* Keep the slowest reads, slowest first */
+        for (cur = HEATMAP_WORST; (cur > 0) && (worst_ticks[cur - 1] < ticks);
+             cur--) {
+            if (cur < HEATMAP_WORST) {
+                worst_ticks[cur] = worst_ticks[cur - 1];
+                worst_pos[cur] = worst_pos[cur - 1];
+            }
+        }
+        if (cur < HEATMAP_WORST) {
+            worst_ticks[cur] = ticks;
+            worst_pos[cur] = pos;
+        }
+
+        if ((iter & 63) == 0) {
+            if (g_output == OUTPUT_TEXT) {
+                printf("Read %u of %u\r", iter, samples);
+                fflush(stdout);
+            }
+            if (is_user_abort()) {
+                print_msg("^C abort\n");
+                rc++;
+                break;
+            }
+        }
+    }
+    if (iter == 0)
+        return (rc);
+
+    if (g_output != OUTPUT_TEXT) {
+        for (row = 0; row < HEATMAP_ROWS; row++) {
+            if (hist[row].count == 0)
+                continue;
+            g_lat_hist = hist[row];
+            print_result("heatmap", start + row_size * row, g_sector_size,
+                         1, buf, hist[row].sum,
+                         (uint64_t) g_sector_size * hist[row].count,
+                         hist[row].count,
+                         ticks_to_usec(hist[row].sum / hist[row].count));
+        }
+        return (rc);
+    }
+
+    printf("Latency heatmap: %u %u byte reads, %u zones of %u MB\n",
+           iter, g_sector_size, HEATMAP_ROWS, (uint) (row_size >> 20));
+    printf("  Offset");
+    for (col = 0; col < HEATMAP_COLS; col++)
+        printf(" %4s", labels[col]);
+    printf(" ms\n");
+    for (row = 0; row < HEATMAP_ROWS; row++) {
+        pos = start + row_size * row;
+        if (end >= (64ULL << 30))
+            printf("%5u GB", (uint) (pos >> 30));
+        else
+            printf("%5u MB", (uint) (pos >> 20));
+        for (col = 0; col < HEATMAP_COLS; col++) {
+            uint level = (grid[row][col] * (sizeof (levels) - 2) +
+                          cell_max - 1) / cell_max;
+            printf(" %c%c%c%c", levels[level], levels[level],
+                   levels[level], levels[level]);
+        }
+        printf("\n");
+    }
+    printf("Slowest reads:\n");
+    for (cur = 0; (cur < HEATMAP_WORST) && (worst_ticks[cur] != 0); cur++) {
+        uint usec = ticks_to_usec(worst_ticks[cur]);
+        printf("  %4u.%03u ms at sector %s\n", usec / 1000, usec % 1000,
+               llu_to_str(worst_pos[cur] / g_sector_size));
+    }
+    return (rc);
+}
+
+#define CMD64_ITERS 1000  // Maximum sector reads to time per command
+
+/*
+ * run_cmd64_cost
+ * --------------
+ * Compare the cost of the 64-bit read command paths (TD64 and NSD)
+ * against CMD_READ at the bandwidth test offset (-s). Each command is
+ * measured for bandwidth at the benchmark transfer size, and for the
+ * average time of sequential single sector reads, which shows the
+ * per-request overhead of the command path. CMD_READ is skipped when
+ * the offset is beyond 4 GB, and commands the driver rejects are shown
+ * as failures.
+ */
+static int
+run_cmd64_cost(struct IOExtTD **tio, uint8_t **buf, uint32_t bufsize,
+               uint num_tio)
+{
+    static const struct {
+        UWORD       cmd;
+        const char *name;
+    } cmds[] = {
+        { CMD_READ,        "CMD_READ" },
+        { TD_READ64,       "TD_READ64" },
+        { NSCMD_TD_READ64, "NSCMD_TD_READ64" },
+    };
+    struct EClockVal stime;
+    struct EClockVal etime;
+    char     name[32];
+    uint64_t pos = bench_offset;
+    uint64_t diff_ticks;
+    uint     xfer_good;
+    uint     rate;
+    uint     iter;
+    uint     lat_us;
+    uint     base_us = 0;
+    uint     i;
+    int      failcode = 0;
+    int      rc = 0;
+
+    if (g_output == OUTPUT_TEXT) {
+        printf("Read command cost at offset %s\n", llu_to_str(pos));
+        printf("  %-16s %15s %12s\n", "Command", "Bandwidth",
+               "Sector read");
+    }
+    for (i = 0; i < ARRAY_SIZE(cmds); i++) {
+        if (g_output == OUTPUT_TEXT)
+            printf("  %-16s ", cmds[i].name);
+        if ((cmds[i].cmd == CMD_READ) &&
+            (((pos + (uint64_t) bufsize * BANDWIDTH_XFERS) >> 32) != 0)) {
+            if (g_output == OUTPUT_TEXT)
+                printf("can't reach offset beyond 4 GB\n");
+            continue;
+        }
+
+        ReadEClock(&stime);
+        for (iter = 0; iter < CMD64_ITERS; iter++) {
+            tio[0]->iotd_Req.io_Command = cmds[i].cmd;
+            tio[0]->iotd_Req.io_Actual  = pos >> 32;
+            tio[0]->iotd_Req.io_Offset  = (uint32_t) pos;
+            tio[0]->iotd_Req.io_Length  = g_sector_size;
+            tio[0]->iotd_Req.io_Data    = buf[0];
+            tio[0]->iotd_Req.io_Flags   = 0;
+            failcode = DoIO((struct IORequest *) tio[0]);
+            if (failcode != 0)
+                break;
+            if ((iter & 0xf) == 0) {
+                ReadEClock(&etime);
+                if (diff_e_clock(&stime, &etime) > g_e_freq) {
+                    iter++;
+                    break;
+                }
+            }
+        }
+        ReadEClock(&etime);
+        if (failcode != 0) {
+            /* Unsupported 64-bit commands are not a benchmark failure */
+            if (g_output == OUTPUT_TEXT)
+                print_fail_nl(failcode);
+            if (cmds[i].cmd == CMD_READ)
+                rc++;
+            continue;
+        }
+        lat_us = ticks_to_usec(diff_e_clock(&stime, &etime) / iter);
+        if (cmds[i].cmd == CMD_READ)
+            base_us = lat_us;
+
+        lat_hist_clear(&g_lat_hist);
+        rc += run_bandwidth_xfers(cmds[i].cmd, tio, buf, bufsize, num_tio,
+                                  pos, BANDWIDTH_XFERS, &diff_ticks,
+                                  &xfer_good);
+        rate = calc_kb_per_sec((uint64_t) bufsize * xfer_good, diff_ticks);
+        sprintf(name, "cmd64 %s", cmds[i].name);
+        result_save(name, bufsize, rate, 1);
+        if (g_output != OUTPUT_TEXT) {
+            print_result(name, pos, bufsize, num_tio, buf[0], diff_ticks,
+                         (uint64_t) bufsize * xfer_good, xfer_good, lat_us);
+            continue;
+        }
+        printf("%8u KB/sec %4u.%03u ms", rate, lat_us / 1000, lat_us % 1000);
+        if ((base_us != 0) && (cmds[i].cmd != CMD_READ)) {
+            if (lat_us >= base_us)
+                printf("  +%u.%03u ms", (lat_us - base_us) / 1000,
+                       (lat_us - base_us) % 1000);
+            else
+                printf("  -%u.%03u ms", (base_us - lat_us) / 1000,
+                       (base_us - lat_us) % 1000);
+        }
+        printf("\n");
+        if (is_user_abort()) {
+            print_msg("^C abort\n");
+            rc++;
+            break;
+        }
+    }
+    return (rc);
+}
+
+#define ZONES_DEFAULT 32
+#define ZONES_MAX     256
+#define ZONES_CHART   40  // Width of zone bandwidth bar chart
+
+/*
+ * run_zone_map
+ * ------------
+ * Split the device (or partition) into the specified number of zones
+ * and measure a short sequential read burst at the start of each. The
+ * result is a table of bandwidth by zone, with a bar chart scaled to
+ * the fastest zone.
+ */
+static int
+run_zone_map(struct IOExtTD **tio, uint8_t **buf, uint32_t bufsize,
+             uint num_tio, uint zones)
+{
+    uint     rate[ZONES_MAX];
+    uint     rate_max = 0;
+    uint     rate_min = 0xffffffff;
+    uint64_t start;
+    uint64_t end;
+    uint64_t zsize;
+    uint64_t zstart;
+    uint64_t diff_ticks;
+    uint     xfer_good;
+    uint     xfers;
+    uint     zone;
+    uint     bar;
+    int      rc = 0;
+    UWORD    iocmd = CMD_READ;
+
+    dev_range(&start, &end);
+    if (end <= start) {
+        print_msg("Device size unknown; can't run zone test\n");
+        return (1);
+    }
+    iocmd = iocmd_for_end(iocmd, end);
+
+    zsize = (end - start) / zones;
+    zsize -= zsize % g_sector_size;
+    while ((bufsize > g_sector_size) && (bufsize > zsize))
+        bufsize >>= 1;
+    if (zsize < bufsize) {
+        print_msg("Device too small for %u zones\n", zones);
+        return (1);
+    }
+    xfers = zsize / bufsize;
+    if (xfers > BANDWIDTH_XFERS)
+        xfers = BANDWIDTH_XFERS;
+
+    for (zone = 0; zone < zones; zone++) {
+        if (g_output == OUTPUT_TEXT) {
+            printf("Zone %u of %u\r", zone + 1, zones);
+            fflush(stdout);
+        }
+        zstart = start + zsize * zone;
+        lat_hist_clear(&g_lat_hist);
+        bench_wrap_end = zstart + zsize;  // With -T, stay within the zone
+        rc += run_bandwidth_xfers(iocmd, tio, buf, bufsize, num_tio, zstart,
+                                  xfers, &diff_ticks, &xfer_good);
+        bench_wrap_end = 0;
+        rate[zone] = calc_kb_per_sec((uint64_t) bufsize * xfer_good,
+                                     diff_ticks);
+        if (g_output != OUTPUT_TEXT)
+            print_result("zone read", zstart - start, bufsize, num_tio,
+                         buf[0], diff_ticks, (uint64_t) bufsize * xfer_good,
+                         xfer_good, 0);
+        if (rate_max < rate[zone])
+            rate_max = rate[zone];
+        if (rate_min > rate[zone])
+            rate_min = rate[zone];
+        if (rc != 0)
+            break;
+        if (is_user_abort()) {
+            print_msg("^C abort\n");
+            rc++;
+            break;
+        }
+    }
+    zones = zone;
+    if ((zones == 0) || (g_output != OUTPUT_TEXT))
+        return (rc);
+    if (rate_max == 0)
+        rate_max = 1;
+
+    printf("Zone       Offset   KB/sec  (%u KB xfers, %u MB zones)\n",
+           bufsize / 1024, (uint) (zsize >> 20));
+    for (zone = 0; zone < zones; zone++) {
+        zstart = zsize * zone;
+        printf("%4u %9u MB %8u  ", zone, (uint) (zstart >> 20), rate[zone]);
+        for (bar = (uint) ((uint64_t) rate[zone] * ZONES_CHART / rate_max);
+             bar > 0; bar--)
+            printf("#");
+        printf("\n");
+    }
+    printf("Minimum %u KB/sec is %u%% of maximum %u KB/sec\n",
+           rate_min, (uint) ((uint64_t) rate_min * 100 / rate_max), rate_max);
+    return (rc);
+}
+
+#define SWEEP_MAX_DEFAULT (4 << 20)
+#define SWEEP_SATURATE    95  // Percent of peak considered saturated
+
+/*
+ * run_size_sweep
+ * --------------
+ * Measure bandwidth at every power of two transfer size from one sector
+ * up to max_size. Small transfers show per-request driver overhead, and
+ * large transfers show the DMA and drive limit. The smallest size which
+ * reaches SWEEP_SATURATE percent of the peak rate is reported as the
+ * point where throughput saturates.
+ */
+static int
+run_size_sweep(UWORD iocmd, struct IOExtTD **tio, uint8_t **buf,
+               uint32_t max_size, uint num_tio)
+{
+    uint     rate[32];
+    uint     size[32];
+    uint     rate_max = 0;
+    uint     count = 0;
+    uint     pos;
+    uint     xfers;
+    uint     xfer_good;
+    uint64_t diff_ticks;
+    uint32_t bufsize;
+    uint64_t offset = bench_offset;
+    UWORD    cmd = iocmd;
+    int      rc = 0;
+    const char *rw = (iocmd == CMD_READ) ? "read " : "write";
+
+    for (bufsize = g_sector_size; bufsize <= max_size; bufsize <<= 1) {
+        /* Transfer about as much data as the standard test, by count */
+        xfers = (uint64_t) BANDWIDTH_XFERS * PERF_BUF_SIZE / bufsize;
+        if (xfers < BANDWIDTH_XFERS)
+            xfers = BANDWIDTH_XFERS;
+
+        lat_hist_clear(&g_lat_hist);
+        if (flag_nocache && (iocmd == CMD_READ))
+            offset = fresh_next((uint64_t) bufsize * xfers);
+        cmd = iocmd_for_end(iocmd, offset + (uint64_t) bufsize * xfers);
+        rc += run_bandwidth_xfers(cmd, tio, buf, bufsize, num_tio, offset,
+                                  xfers, &diff_ticks, &xfer_good);
+        size[count] = bufsize;
+        rate[count] = calc_kb_per_sec((uint64_t) bufsize * xfer_good,
+                                      diff_ticks);
+        if (rate_max < rate[count])
+            rate_max = rate[count];
+
+        if (g_output != OUTPUT_TEXT) {
+            print_result((iocmd == CMD_READ) ? "sweep read" : "sweep write",
+                         offset, bufsize, num_tio, buf[0], diff_ticks,
+                         (uint64_t) bufsize * xfer_good, xfer_good, 0);
+        } else {
+            printf("%s %4u %s xfers %8u KB/sec %7u IOPS", rw,
+                   (bufsize < 1024) ? bufsize : bufsize / 1024,
+                   (bufsize < 1024) ? "B " : "KB", rate[count],
+                   (uint) ((uint64_t) xfer_good * g_e_freq /
+                           (diff_ticks ? diff_ticks : 1)));
+            print_cpu_busy(g_cpu_busy, rate[count]);
+            printf("\n");
+            if (flag_lat_hist)
+                print_lat_hist(&g_lat_hist);
+        }
+        count++;
+        if (rc != 0)
+            break;
+        if (is_user_abort()) {
+            print_msg("^C abort\n");
+            rc++;
+            break;
+        }
+    }
+    if ((count == 0) || (rate_max == 0) || (g_output != OUTPUT_TEXT))
+        return (rc);
+
+    for (pos = 0; pos < count; pos++)
+        if ((uint64_t) rate[pos] * 100 >= (uint64_t) rate_max * SWEEP_SATURATE)
+            break;
+    printf("%s saturates at %u %s xfers: %u KB/sec is %u%% of peak "
+           "%u KB/sec\n", (iocmd == CMD_READ) ? "Read" : "Write",
+           (size[pos] < 1024) ? size[pos] : size[pos] / 1024,
+           (size[pos] < 1024) ? "byte" : "KB", rate[pos],
+           (uint) ((uint64_t) rate[pos] * 100 / rate_max), rate_max);
+    return (rc);
+}
+
+/*
+ * Extended benchmark tests, selected with -e <test>. These replace the
+ * default bandwidth test; -bb latency tests may still be added.
+ */
+#define BENCH_QDEPTH    BIT(0)
+#define BENCH_RANDOM    BIT(1)
+#define BENCH_ZONES     BIT(2)
+#define BENCH_SWEEP     BIT(3)
+#define BENCH_MEMTYPES  BIT(4)
+#define BENCH_MIXED     BIT(5)
+#define BENCH_CMD64     BIT(6)
+#define BENCH_LOADED    BIT(7)
+#define BENCH_REPLAY    BIT(8)
+#define BENCH_RATE      BIT(9)
+#define BENCH_SEEK      BIT(10)
+#define BENCH_RPM       BIT(11)
+#define BENCH_CACHE     BIT(12)
+#define BENCH_WCACHE    BIT(13)
+#define BENCH_REORDER   BIT(14)
+#define BENCH_HEATMAP   BIT(15)
+
+/*
+ * Extended benchmark test arguments. These are parsed and checked by
+ * the bench_parse_*() functions while the command line is parsed, so
+ * that a bad argument is reported before anything is allocated. Checks
+ * which depend on the device (such as sector size) are made when the
+ * test is run.
+ */
+static uint        bench_seed            = RANDOM_SEED_DEFAULT;
+static uint        bench_zones           = ZONES_DEFAULT;
+static uint        bench_sweep_max       = SWEEP_MAX_DEFAULT;
+static uint        bench_mixed_pct       = MIXED_READ_PCT_DEFAULT;
+static uint        bench_mixed_size      = 0;
+static uint        bench_mixed_random    = 0;
+static uint        bench_probe_size      = 512;
+static const char *bench_trace_file      = NULL;
+static uint        bench_trace_timed     = 0;
+static uint        bench_rate            = 0;
+static uint        bench_rate_bytes      = 0;
+static uint        bench_rate_size       = 0;
+static uint        bench_rate_random     = 0;
+static uint        bench_seek_points     = SEEK_POINTS_DEFAULT;
+static uint        bench_heatmap_samples = HEATMAP_SAMPLES;
+static uint        bench_cache_max       = CACHE_SET_DEFAULT;
+static uint        bench_wcache_size     = WCACHE_SIZE;
+
+static int
+bench_parse_random(char *arg)
+{
+    if ((arg != NULL) && parse_count(arg, &bench_seed, 0, 0xffffffff)) {
+        printf("Invalid random seed \"%s\"\n", arg);
+        return (1);
+    }
+    return (0);
+}
+
+static int
+bench_parse_zones(char *arg)
+{
+    if ((arg != NULL) && parse_count(arg, &bench_zones, 1, ZONES_MAX)) {
+        printf("Invalid zone count \"%s\" (1 to %u)\n", arg, ZONES_MAX);
+        return (1);
+    }
+    return (0);
+}
+
+static int
+bench_parse_sweep(char *arg)
+{
+    int pos;
+
+    if (arg == NULL)
+        return (0);
+    parse_tsize(arg, &bench_sweep_max, &pos);
+    if ((arg[pos] != '\0') || (bench_sweep_max < 512)) {
+        printf("Invalid sweep size %s (minimum 512)\n", arg);
+        return (1);
     }
+    return (0);
 }
 
-static uint32_t user_perf_size = 0;
-static uint     user_num_tio   = 0;
+static int
+bench_parse_mixed(char *arg)
+{
+    return (parse_mixed_arg(arg, &bench_mixed_pct, &bench_mixed_size,
+                            &bench_mixed_random));
+}
 
 static int
-run_bandwidth(UWORD iocmd, struct IOExtTD **tio, uint8_t **buf,
-              uint32_t bufsize, uint num_tio)
+bench_parse_loaded(char *arg)
 {
-    int xfer;
-    int xfer_good;
-    uint i;
-    int rc = 0;
-    uint32_t issued;
-    uint cur = 0;
-    uint32_t pos;
-    struct EClockVal stime;
-    struct EClockVal etime;
-    uint32_t freq;
-    uint32_t diff_ticks;
-    uint64_t xfer_total;
+    int pos;
 
-    int rep;
+    if (arg == NULL)
+        return (0);
+    parse_tsize(arg, &bench_probe_size, &pos);
+    if ((arg[pos] != '\0') || (bench_probe_size == 0) ||
+        (bench_probe_size > BUFSIZE)) {
+        printf("Invalid probe size %s (maximum %u)\n", arg, BUFSIZE);
+        return (1);
+    }
+    return (0);
+}
 
-    for (rep = 0; rep < 10; rep++) {
-        pos = 0;
-        issued = 0;
+static int
+bench_parse_replay(char *arg)
+{
+    char *ptr;
 
-        ReadEClock(&stime);
+    if ((arg == NULL) || (*arg == '\0')) {
+        printf("replay requires a trace file: -e replay(file)\n");
+        return (1);
+    }
+    if ((ptr = strrchr(arg, ',')) != NULL) {
+        if (strcasecmp(ptr + 1, "timed") != 0) {
+            printf("Invalid replay mode \"%s\" (timed)\n", ptr + 1);
+            return (1);
+        }
+        *ptr = '\0';
+        bench_trace_timed = 1;
+    }
+    bench_trace_file = arg;
+    return (0);
+}
 
-        print_perf_type((iocmd == CMD_READ) ? 0 : 1, bufsize);
-        xfer_good = 0;
-        for (xfer = 0; xfer < 50; xfer++) {
-            if (issued & BIT(cur)) {
-                int failcode = WaitIO((struct IORequest *) tio[cur]);
-                if (failcode == 0)
-                    failcode = tio[cur]->iotd_Req.io_Error;
-                issued &= ~BIT(cur);
-                if (failcode == 0) {
-                    xfer_good++;
-                } else {
-                    printf("  %s ", (iocmd == CMD_READ) ? "Read" : "Write");
-                    print_fail(failcode);
-                    printf(" at 0x%x\n", U32(tio[cur]->iotd_Req.io_Offset));
-                    rc++;
-                    break;
-                }
-                if ((xfer & 0x7) == 0) {
-                    /* Cut out early if device is slow (> 1 second) */
-                    ReadEClock(&etime);
-                    if (diff_e_clock(&stime, &etime) > g_e_freq) {
-                        break;
-                    }
-                }
-            }
+static int
+bench_parse_rate(char *arg)
+{
+    return (parse_rate_arg(arg, &bench_rate, &bench_rate_bytes,
+                           &bench_rate_size, &bench_rate_random));
+}
 
-            tio[cur]->iotd_Req.io_Command = iocmd;
-            tio[cur]->iotd_Req.io_Actual = 0;
-            tio[cur]->iotd_Req.io_Data = buf[cur];
-            tio[cur]->iotd_Req.io_Length = bufsize;
-            tio[cur]->iotd_Req.io_Offset = pos;
-            SendIO((struct IORequest *) tio[cur]);
-            issued |= BIT(cur);
-            pos += bufsize;
-            if (++cur >= num_tio)
-                cur = 0;
-        }
-        for (i = 0; i < num_tio; i++) {
-            if (issued & BIT(cur)) {
-                int failcode = WaitIO((struct IORequest *) tio[cur]);
-                if (failcode == 0)
-                    failcode = tio[cur]->iotd_Req.io_Error;
-                issued &= ~BIT(cur);
-                if (failcode == 0) {
-                    xfer_good++;
-                } else {
-                    printf("  %s ", (iocmd == CMD_READ) ? "Read" : "Write");
-                    print_fail(failcode);
-                    printf(" at 0x%x\n", U32(tio[cur]->iotd_Req.io_Offset));
-                    rc++;
-                }
-            }
-            if (++cur >= num_tio)
-                cur = 0;
-        }
+static int
+bench_parse_seek(char *arg)
+{
+    if ((arg != NULL) &&
+        parse_count(arg, &bench_seek_points, 2, SEEK_POINTS_MAX)) {
+        printf("Invalid seek point count \"%s\" (2 to %u)\n",
+               arg, SEEK_POINTS_MAX);
+        return (1);
+    }
+    return (0);
+}
 
-        freq = ReadEClock(&etime);
-        diff_ticks = diff_e_clock(&stime, &etime);
+static int
+bench_parse_heatmap(char *arg)
+{
+    if ((arg != NULL) &&
+        parse_count(arg, &bench_heatmap_samples, HEATMAP_ROWS, HEATMAP_MAX)) {
+        printf("Invalid heatmap sample count \"%s\" (%u to %u)\n",
+               arg, HEATMAP_ROWS, HEATMAP_MAX);
+        return (1);
+    }
+    return (0);
+}
 
-        xfer_total = (uint64_t) bufsize * (uint64_t) xfer_good / 1000;
-        print_perf(diff_ticks, freq, (uint) xfer_total,
-                   (iocmd == CMD_READ) ? 0 : 1, bufsize);
-        bufsize >>= 2;
-        if (bufsize < 16384)
-            break;
+static int
+bench_parse_cache(char *arg)
+{
+    int pos;
 
-        if (is_user_abort()) {
-            printf("^C abort\n");
-            rc++;
-            break;
-        }
-        if (user_perf_size != 0)
-            break;  // Only run the specified size
+    if (arg == NULL)
+        return (0);
+    parse_tsize(arg, &bench_cache_max, &pos);
+    if ((arg[pos] != '\0') || (bench_cache_max < CACHE_SET_MIN * 2) ||
+        (bench_cache_max > CACHE_SET_MAX)) {
+        printf("Invalid cache test size %s (%u KB to %u MB)\n",
+               arg, CACHE_SET_MIN * 2 >> 10, CACHE_SET_MAX >> 20);
+        return (1);
     }
+    return (0);
+}
 
-    return (rc);
+static int
+bench_parse_wcache(char *arg)
+{
+    int pos;
+
+    if (arg == NULL)
+        return (0);
+    parse_tsize(arg, &bench_wcache_size, &pos);
+    if ((arg[pos] != '\0') || (bench_wcache_size == 0)) {
+        printf("Invalid write size %s\n", arg);
+        return (1);
+    }
+    return (0);
 }
 
+typedef struct {
+    const char         alias[12];
+    uint32_t           mask;
+    const char * const args;
+    int              (*parse)(char *arg);  // Check and save args
+    const char * const desc;
+} bench_modes_t;
+
+static const bench_modes_t bench_modes[] = {
+    { "qdepth",     BENCH_QDEPTH, NULL,                  NULL,
+                    "Bandwidth vs. queue depth (1 to 32 TIOs)" },
+    { "random",     BENCH_RANDOM, "[seed]",              bench_parse_random,
+                    "Random 512 byte, 4K, and 8K transfer IOPS" },
+    { "zones",      BENCH_ZONES,  "[zones]",             bench_parse_zones,
+                    "Read bandwidth across media (default 32 zones)" },
+    { "sweep",      BENCH_SWEEP,  "[maxsize]",           bench_parse_sweep,
+                    "Bandwidth at each size, 512 bytes to 4 MB" },
+    { "memtypes",   BENCH_MEMTYPES, NULL,                NULL,
+                    "Bandwidth with buffers in each memory region" },
+    { "mixed",      BENCH_MIXED,  "[rd%,tsize,pattern]", bench_parse_mixed,
+                    "Interleaved reads and writes (default 70% read)" },
+    { "cmd64",      BENCH_CMD64,  NULL,                  NULL,
+                    "CMD_READ vs. TD64 and NSD read cost at -s offset" },
+    { "loaded",     BENCH_LOADED, "[probesize]",         bench_parse_loaded,
+                    "Small random read latency under sequential load" },
+    { "replay",     BENCH_REPLAY, "file[,timed]",        bench_parse_replay,
+                    "Replay a block I/O trace file" },
+    { "rate",       BENCH_RATE,   "iops[,tsize[,rand]]", bench_parse_rate,
+                    "Open-loop reads at target IOPS (or <n>M MB/sec)" },
+    { "seek",       BENCH_SEEK,   "[points]",            bench_parse_seek,
+                    "Read latency vs. seek distance (default 32 points)" },
+    { "rpm",        BENCH_RPM,    NULL,                  NULL,
+                    "Rotation period, RPM, and rotational latency" },
+    { "cache",      BENCH_CACHE,  "[maxsize]",           bench_parse_cache,
+                    "Drive read cache size and read-ahead depth" },
+    { "wcache",     BENCH_WCACHE, "[tsize]",             bench_parse_wcache,
+                    "Write cache detection and flush latency (-d)" },
+    { "reorder",    BENCH_REORDER, NULL,                 NULL,
+                    "Detect request reordering (TCQ/NCQ or elevator)" },
+    { "heatmap",    BENCH_HEATMAP, "[samples]",          bench_parse_heatmap,
+                    "Read latency by device offset (default 4096 reads)" },
+};
+
+static uint32_t bench_mask = 0;
+
 static const char *
 memtype_str(uint32_t mem)
 {
@@ -2497,18 +6897,67 @@ drive_benchmark(int do_destructive, uint32_t memtype)
     uint8_t *buf[MAX_NUM_TIO];
     uint32_t opened;
     uint32_t perf_buf_size = PERF_BUF_SIZE;
+    uint32_t sweep_size = bench_sweep_max;
+    uint32_t alloc_size;
     struct MsgPort *mp;
     size_t i;
     int rc = 0;
     uint num_tio = NUM_TIO;
+    uint max_tio;
+    uint64_t devstart;
+    uint64_t devend;
 
-    if (user_perf_size != 0)
+    if (user_perf_size != 0) {
         perf_buf_size = user_perf_size;
+        sweep_size = user_perf_size;
+    }
+
+    /*
+     * Tests which take their own transfer size may need larger buffers,
+     * but the other tests keep using perf_buf_size.
+     */
+    alloc_size = perf_buf_size;
+    if ((bench_mask & BENCH_SWEEP) && (alloc_size < sweep_size))
+        alloc_size = sweep_size;
+    if (bench_mask & BENCH_MIXED) {
+        if ((bench_mixed_pct < 100) && !do_destructive) {
+            printf("Mixed read/write test requires -d\n");
+            return (1);
+        }
+        if (alloc_size < bench_mixed_size)
+            alloc_size = bench_mixed_size;
+    }
+    if ((bench_mask & BENCH_WCACHE) && !do_destructive) {
+        printf("Write cache test requires -d\n");
+        return (1);
+    }
+    if ((bench_mask & BENCH_RATE) && (alloc_size < bench_rate_size))
+        alloc_size = bench_rate_size;
     if (user_num_tio != 0)
         num_tio = user_num_tio;
     if (num_tio > MAX_NUM_TIO)
         num_tio = MAX_NUM_TIO;
 
+    /*
+     * The queue depth sweep needs more outstanding requests than the
+     * default test. Those extra requests share the num_tio buffers.
+     */
+    max_tio = num_tio;
+    if ((bench_mask & (BENCH_QDEPTH | BENCH_RATE)) && (user_num_tio == 0))
+        max_tio = MAX_NUM_TIO;
+    if ((bench_mask & BENCH_REORDER) && (user_num_tio == 0) &&
+        (max_tio < REORDER_TIO))
+        max_tio = REORDER_TIO;
+
+    /*
+     * The loaded test needs one more request for the probe. At the
+     * maximum depth, its stream gives up a request instead; the other
+     * tests keep num_tio.
+     */
+    if ((bench_mask & BENCH_LOADED) && (max_tio < num_tio + 1) &&
+        (num_tio < MAX_NUM_TIO))
+        max_tio = num_tio + 1;
+
     mp = CreatePort(0, 0);
     if (mp == NULL) {
         printf("Failed to create message port\n");
@@ -2516,7 +6965,7 @@ drive_benchmark(int do_destructive, uint32_t memtype)
     }
 
     memset(tio, 0, sizeof (tio));
-    for (i = 0; i < num_tio; i++) {
+    for (i = 0; i < max_tio; i++) {
         tio[i] = (struct IOExtTD *) CreateExtIO(mp, sizeof (struct IOExtTD));
         if (tio[i] == NULL) {
             printf("Failed to create tio struct\n");
@@ -2526,7 +6975,7 @@ drive_benchmark(int do_destructive, uint32_t memtype)
     }
 
     opened = 0;
-    for (i = 0; i < num_tio; i++) {
+    for (i = 0; i < max_tio; i++) {
         if ((rc = open_device(tio[i])) != 0) {
             printf("Open %s Unit %u: ", g_devname, g_unitno);
             print_fail_nl(rc);
@@ -2541,17 +6990,17 @@ try_again:
     for (i = 0; i < num_tio; i++) {
         uint32_t amemtype = memtype;
         if (amemtype > 0x10000)
-            amemtype += perf_buf_size * i;
-        buf[i] = (uint8_t *) AllocMemType(perf_buf_size, amemtype);
+            amemtype += alloc_size * i;
+        buf[i] = (uint8_t *) AllocMemType(alloc_size, amemtype);
         if (buf[i] == NULL) {
-            if (perf_buf_size > 8192) {
+            if (alloc_size > 8192) {
                 /* Restart loop, asking for a smaller buffer */
                 size_t j;
                 for (j = 0; j < i; j++) {
-                    FreeMemType(buf[j], perf_buf_size);
+                    FreeMemType(buf[j], alloc_size);
                     buf[j] = NULL;
                 }
-                perf_buf_size /= 2;
+                alloc_size /= 2;
                 goto try_again;
             }
             printf("Unable to allocate ");
@@ -2565,33 +7014,180 @@ try_again:
             goto allocmem_fail;
         }
     }
-    printf("Test %s %u with %s RAM",
-           g_devname, g_unitno, memtype_str((uint32_t) buf[0]));
-    if (g_verbose) {
-        for (i = 0; i < num_tio; i++)
-            printf(" %08x", U32(buf[i]));
+    for (i = num_tio; i < max_tio; i++)
+        buf[i] = buf[i % num_tio];
+    if (perf_buf_size > alloc_size)
+        perf_buf_size = alloc_size;
+    if (sweep_size > alloc_size)
+        sweep_size = alloc_size;
+
+    if (g_output == OUTPUT_TEXT) {
+        printf("Test %s %u with %s RAM",
+               g_devname, g_unitno, memtype_str((uint32_t) buf[0]));
+        if (g_verbose) {
+            for (i = 0; i < num_tio; i++)
+                printf(" %08x", U32(buf[i]));
+        }
+        printf("\n");
+    }
+
+    if (((bench_mask & (BENCH_RANDOM | BENCH_ZONES | BENCH_MIXED |
+                        BENCH_LOADED | BENCH_REPLAY | BENCH_RATE |
+                        BENCH_SEEK | BENCH_RPM | BENCH_CACHE |
+                        BENCH_WCACHE | BENCH_REORDER | BENCH_HEATMAP)) ||
+         flag_nocache || (bench_duration != 0) || (bench_offset != 0)) &&
+        (g_devsize == 0) && (g_devend == 0) && (get_devsize(tio[0]) != 0)) {
+        printf("Unable to determine device size\n");
+        rc++;
+    }
+    if ((bench_offset % g_sector_size) != 0) {
+        bench_offset -= bench_offset % g_sector_size;
+        print_msg("Offset rounded down to %s for %u byte sectors\n",
+                  llu_to_str(bench_offset), g_sector_size);
+    }
+    dev_range(&devstart, &devend);
+    if ((bench_offset != 0) && (rc == 0) &&
+        (bench_offset + (uint64_t) perf_buf_size * BANDWIDTH_XFERS > devend)) {
+        printf("Offset %s is too close to the end of the device\n",
+               llu_to_str(bench_offset));
+        rc++;
+    }
+    if (flag_nocache && (rc == 0))
+        rc += fresh_init(alloc_size);
+
+    if ((bench_mask == 0) && (rc == 0)) {
+        rc += run_bandwidth(CMD_READ, tio, buf, perf_buf_size, num_tio);
+
+        if (do_destructive && (rc == 0))
+            rc += run_bandwidth(CMD_WRITE, tio, buf, perf_buf_size, num_tio);
+    }
+
+    if ((bench_mask & BENCH_QDEPTH) && (rc == 0)) {
+        rc += run_qdepth_sweep(CMD_READ, tio, buf, perf_buf_size, max_tio);
+
+        if (do_destructive && (rc == 0))
+            rc += run_qdepth_sweep(CMD_WRITE, tio, buf, perf_buf_size,
+                                   max_tio);
     }
-    printf("\n");
 
-    rc += run_bandwidth(CMD_READ, tio, buf, perf_buf_size, num_tio);
+    if ((bench_mask & BENCH_SWEEP) && (rc == 0)) {
+        rc += run_size_sweep(CMD_READ, tio, buf, sweep_size, num_tio);
+
+        if (do_destructive && (rc == 0))
+            rc += run_size_sweep(CMD_WRITE, tio, buf, sweep_size, num_tio);
+    }
+
+    if ((bench_mask & BENCH_RANDOM) && (rc == 0)) {
+        rc += run_random_iops(CMD_READ, tio, buf, num_tio, bench_seed);
+
+        if (do_destructive && (rc == 0))
+            rc += run_random_iops(CMD_WRITE, tio, buf, num_tio, bench_seed);
+    }
+
+    if ((bench_mask & BENCH_ZONES) && (rc == 0))
+        rc += run_zone_map(tio, buf, perf_buf_size, num_tio, bench_zones);
+
+    if ((bench_mask & BENCH_SEEK) && (rc == 0))
+        rc += run_seek_profile(tio[0], buf[0], bench_seek_points);
+
+    if ((bench_mask & BENCH_RPM) && (rc == 0))
+        rc += run_rpm(tio[0], buf[0]);
+
+    if ((bench_mask & BENCH_HEATMAP) && (rc == 0))
+        rc += run_heatmap(tio[0], buf[0], bench_heatmap_samples);
+
+    if ((bench_mask & BENCH_REORDER) && (rc == 0))
+        rc += run_reorder(tio, buf, (user_num_tio != 0) ? num_tio :
+                                    REORDER_TIO);
+
+    if ((bench_mask & BENCH_CACHE) && (rc == 0))
+        rc += run_cache_detect(tio[0], buf[0], perf_buf_size,
+                               bench_cache_max);
+
+    if ((bench_mask & BENCH_WCACHE) && (rc == 0)) {
+        if ((bench_wcache_size % g_sector_size) ||
+            (bench_wcache_size > alloc_size)) {
+            printf("Invalid write size %u (sector multiple, maximum %u)\n",
+                   bench_wcache_size, alloc_size);
+            rc++;
+        } else {
+            rc += run_wcache(tio[0], buf[0], bench_wcache_size);
+        }
+    }
+
+    if ((bench_mask & BENCH_CMD64) && (rc == 0))
+        rc += run_cmd64_cost(tio, buf, perf_buf_size, num_tio);
+
+    if ((bench_mask & BENCH_REPLAY) && (rc == 0)) {
+        uint         count;
+        trace_rec_t *recs;
+
+        if (trace_load(bench_trace_file, alloc_size, do_destructive,
+                       &recs, &count)) {
+            rc++;
+        } else {
+            rc += run_replay(tio, buf, num_tio, recs, count,
+                             bench_trace_timed);
+            FreeMem(recs, count * sizeof (trace_rec_t));
+        }
+    }
+
+    if ((bench_mask & BENCH_LOADED) && (rc == 0)) {
+        uint probe_size = bench_probe_size;
+        uint stream_tio = (num_tio < MAX_NUM_TIO) ? num_tio : num_tio - 1;
+
+        if (probe_size < g_sector_size)
+            probe_size = g_sector_size;
+        if (probe_size % g_sector_size) {
+            printf("Invalid probe size %u (multiple of %u byte sectors)\n",
+                   probe_size, g_sector_size);
+            rc++;
+        } else {
+            rc += run_loaded(tio, buf, perf_buf_size, stream_tio,
+                             tio[stream_tio], probe_size);
+        }
+    }
+
+    if ((bench_mask & BENCH_MIXED) && (rc == 0)) {
+        uint mixed_size = bench_mixed_size;
+
+        if (mixed_size == 0)
+            mixed_size = perf_buf_size;
+        if (mixed_size > alloc_size)
+            mixed_size = alloc_size;  // Allocation may have reduced it
+        rc += run_mixed(tio, buf, mixed_size, num_tio, bench_mixed_pct,
+                        bench_mixed_random);
+    }
+    if ((bench_mask & BENCH_RATE) && (rc == 0)) {
+        uint rate = bench_rate;
+        uint rate_size = bench_rate_size;
 
-    if (do_destructive && (rc == 0))
-        rc += run_bandwidth(CMD_WRITE, tio, buf, perf_buf_size, num_tio);
+        if (rate_size == 0)
+            rate_size = (g_sector_size > 4096) ? g_sector_size : 4096;
+        if (rate_size > alloc_size)
+            rate_size = alloc_size;
+        if (bench_rate_bytes)
+            rate /= rate_size;
+        if (rate == 0)
+            rate = 1;
+        rc += run_rate(tio, buf, rate_size, max_tio, rate,
+                       bench_rate_random);
+    }
 
     g_turn_motor_off = 1;
 
 allocmem_fail:
     for (i = 0; i < num_tio; i++)
         if (buf[i] != NULL)
-            FreeMemType(buf[i], perf_buf_size);
+            FreeMemType(buf[i], alloc_size);
 
 opendevice_fail:
-    for (i = 0; i < num_tio; i++)
+    for (i = 0; i < max_tio; i++)
         if ((opened & BIT(i)) != 0)
             close_device(tio[i]);
 
 create_tio_fail:
-    for (i = 0; i < num_tio; i++)
+    for (i = 0; i < max_tio; i++)
         if (tio[i] != NULL)
             DeleteExtIO((struct IORequest *) tio[i]);
 
@@ -2600,6 +7196,124 @@ create_tio_fail:
     return (rc);
 }
 
+#define MEMREGION_MAX 16
+#define MEMREGION_COL 4
+
+/*
+ * drive_memtype_matrix
+ * --------------------
+ * Run the standard bandwidth test once for each memory region in the
+ * Exec memory list, with the transfer buffers placed in the largest free
+ * chunk of that region. The results are then summarized as a table of
+ * bandwidth by memory region and transfer size. Only the results from
+ * the first region tested are kept for -S and -R, as every region saves
+ * under the same names. Any other -e tests are then run once, with
+ * buffers of the specified memtype.
+ */
+static int
+drive_memtype_matrix(int do_destructive, uint32_t memtype)
+{
+    static result_t keep[RESULT_MAX];
+    struct ExecBase  *eb = SysBase;
+    struct MemHeader *mem;
+    struct MemChunk  *chunk;
+    uint32_t region[MEMREGION_MAX];
+    uint32_t rchunk[MEMREGION_MAX];
+    uint32_t rsize[MEMREGION_MAX];
+    uint     rate[2][MEMREGION_MAX][MEMREGION_COL];
+    uint     size[MEMREGION_COL];
+    uint     num_tio = (user_num_tio != 0) ? user_num_tio : NUM_TIO;
+    uint32_t mask = bench_mask & ~BENCH_MEMTYPES;
+    uint     base = g_result_count;
+    uint     kept = 0;
+    uint     tested = 0;
+    uint     regions = 0;
+    uint     cols = 0;
+    uint     r;
+    uint     c;
+    uint     w;
+    int      rc = 0;
+
+    Forbid();
+    for (mem = (struct MemHeader *)eb->MemList.lh_Head;
+         (mem->mh_Node.ln_Succ != NULL) && (regions < MEMREGION_MAX);
+         mem = (struct MemHeader *)mem->mh_Node.ln_Succ) {
+        uint32_t upper = (uintptr_t) mem->mh_Upper;
+        rchunk[regions] = 0;
+        rsize[regions] = 0;
+        for (chunk = mem->mh_First; chunk != NULL; chunk = chunk->mc_Next) {
+            if ((uintptr_t) chunk + chunk->mc_Bytes > upper)
+                break;  // Corrupt memory list?
+            if (rsize[regions] < chunk->mc_Bytes) {
+                rchunk[regions] = (uintptr_t) chunk;
+                rsize[regions] = chunk->mc_Bytes;
+            }
+        }
+        region[regions++] = (uintptr_t) mem;
+    }
+    Permit();
+
+    size[0] = (user_perf_size != 0) ? user_perf_size : PERF_BUF_SIZE;
+    for (cols = 1; cols < MEMREGION_COL; cols++) {
+        if ((user_perf_size != 0) || ((size[cols - 1] >> 2) < 16384))
+            break;
+        size[cols] = size[cols - 1] >> 2;
+    }
+
+    memset(rate, 0, sizeof (rate));
+    bench_mask = 0;  // Standard bandwidth test only
+    for (r = 0; r < regions; r++) {
+        if (rsize[r] < num_tio * 8192) {
+            if (g_output == OUTPUT_TEXT)
+                printf("%s RAM at 0x%08x has no free memory to test\n",
+                       memtype_str(region[r]), U32(region[r]));
+            continue;
+        }
+        g_result_count = base;
+        rc += drive_benchmark(do_destructive, rchunk[r]);
+        for (c = 0; c < cols; c++) {
+            rate[0][r][c] = result_find("read", size[c]);
+            rate[1][r][c] = result_find("write", size[c]);
+        }
+        if (tested++ == 0) {
+            kept = g_result_count - base;
+            memcpy(keep, g_results + base, kept * sizeof (result_t));
+        }
+        if (is_user_abort()) {
+            rc++;
+            break;
+        }
+    }
+    memcpy(g_results + base, keep, kept * sizeof (result_t));
+    g_result_count = base + kept;
+    bench_mask = mask | BENCH_MEMTYPES;
+
+    for (w = 0; (g_output == OUTPUT_TEXT) && (w <= (do_destructive ? 1 : 0));
+         w++) {
+        printf("\n%-22s", w ? "Write KB/sec" : "Read KB/sec");
+        for (c = 0; c < cols; c++)
+            printf(" %5u KB", size[c] / 1024);
+        printf("\n");
+        for (r = 0; r < regions; r++) {
+            printf("%-11s 0x%08x", memtype_str(region[r]), U32(region[r]));
+            for (c = 0; c < cols; c++) {
+                if (rate[w][r][c] == 0)
+                    printf(" %8s", "-");
+                else
+                    printf(" %8u", rate[w][r][c]);
+            }
+            printf("\n");
+        }
+    }
+
+    if ((mask != 0) && (rc == 0)) {
+        bench_mask = mask;
+        rc += drive_benchmark(do_destructive, memtype);
+        bench_mask = mask | BENCH_MEMTYPES;
+    }
+    return (rc);
+}
+
 static int
 do_read_cmd(struct IOExtTD *tio, uint64_t offset, uint len, void *buf, int nsd)
 {
@@ -4846,36 +9560,12 @@ find_startup(char *name)
         startup = NULL;
     }
 
-    CloseLibrary((struct Library *)DosBase);
-
-    if (pos != NULL)
-        *pos = ':';
-
-    return (startup);
-}
-
-/*
- * rand32
- * ------
- * Very simple pseudo-random number generator
- */
-static uint32_t rand_seed = 0;
-static uint32_t
-rand32(void)
-{
-    rand_seed = (rand_seed * 25173) + 13849;
-    return (rand_seed);
-}
+    CloseLibrary((struct Library *)DosBase);
 
-/*
- * srand32
- * -------
- * Very simple random number seed
- */
-static void
-srand32(uint32_t seed)
-{
-    rand_seed = seed;
+    if (pos != NULL)
+        *pos = ':';
+
+    return (startup);
 }
 
 static void
@@ -4917,6 +9607,79 @@ static const uint8_t chkpat[] = {
     0xa5, 0x5a, 0xc3, 0x3c, 0x81, 0x00, 0xff
 };
 
+/*
+ * integrity_miscompare
+ * --------------------
+ * Report a miscompare found by the simple or pipeline integrity test.
+ * The data at pos is read again into a freshly patterned buffer, and the
+ * two reads are compared against what was written (wbuf, destructive
+ * mode) and what was originally on disk (obuf, NULL with -dd) to suggest
+ * where the failure lies. Returns the re-read error, or 1 otherwise.
+ */
+static int
+integrity_miscompare(struct IOExtTD *tio, uint64_t pos, uint bufsize,
+                     uint8_t *wbuf, uint8_t *obuf, uint8_t *rbuf)
+{
+    int rc;
+
+    printf("Miscompare at %s\n", llu_sector_to_str(pos));
+    if (memcmp_const(rbuf, bufsize, 0xa5) == 0) {
+        printf("Read buffer was not updated\n");
+    } else if (flag_destructive) {
+        show_diffs(wbuf, rbuf, bufsize, "expected");
+    } else {
+        show_diffs(obuf, rbuf, bufsize, "original");
+    }
+
+    /* Pattern the second read buffer */
+    memset(g_align[3], 0x5a, bufsize);
+
+    rc = do_read_cmd(tio, pos, bufsize, g_align[3], g_has_nsd);
+    if (rc != 0) {
+        printf("Re-read failed at %s\n", llu_sector_to_str(pos));
+        return (rc);
+    }
+    if (memcmp_const(g_align[3], bufsize, 0x5a) == 0) {
+        printf("Re-read buffer was not updated\n");
+    } else if (memcmp(rbuf, g_align[3], bufsize) == 0) {
+        if (flag_destructive) {
+            printf("Re-read of data matches what was read "
+                   "(write failure?)\n");
+        } else {
+            printf("Re-read of data matches what was read "
+                   "the second time\n");
+        }
+    } else if (flag_destructive &&
+               (memcmp(wbuf, g_align[3], bufsize) == 0)) {
+        printf("Re-read of data matches what was written "
+               "(read failure?)\n");
+    } else if ((obuf != NULL) && (memcmp(obuf, g_align[3], bufsize) == 0)) {
+        printf("Re-read of data matches what was originally on disk\n");
+    } else {
+        printf("Re-read of data differs (floating data?)\n");
+        if (flag_destructive) {
+            show_diffs(wbuf, g_align[3], bufsize, "expected");
+            show_diffs(rbuf, g_align[3], bufsize, "first read");
+        } else {
+            show_diffs(obuf, g_align[3], bufsize, "first read");
+            show_diffs(rbuf, g_align[3], bufsize, "second read");
+        }
+    }
+    CacheClearU();
+    if (flag_destructive) {
+        if (memcmp(wbuf, rbuf, bufsize) == 0) {
+            printf("Initial read data now matches what was written "
+                   "(CPU cache or memory failure?)\n");
+        }
+    } else {
+        if (memcmp(obuf, rbuf, bufsize) == 0) {
+            printf("Initial read data now matches second read "
+                   "(CPU cache or memory failure?)\n");
+        }
+    }
+    return (1);
+}
+
 static int
 test_integrity_simple(struct IOExtTD *tio, uint bufsize)
 {
@@ -4981,62 +9744,8 @@ test_integrity_simple(struct IOExtTD *tio, uint bufsize)
          * (destructive mode) or mismatches the previously read data
          * (read-only mode).
          */
-        printf("Miscompare at %s\n", llu_sector_to_str(pos));
-        if (memcmp_const(g_align[2], bufsize, 0xa5) == 0) {
-            printf("Read buffer was not updated\n");
-        } else if (flag_destructive) {
-            show_diffs(g_align[curbuf], g_align[2], bufsize, "expected");
-        } else {
-            show_diffs(g_ibuf[4], g_align[2], bufsize, "original");
-        }
-
-        /* Pattern the second read buffer */
-        memset(g_align[3], 0x5a, bufsize);
-
-        rc = do_read_cmd(tio, pos, bufsize, g_align[3], g_has_nsd);
-        if (rc != 0) {
-            printf("Re-read failed at %s\n", llu_sector_to_str(pos));
-            goto integrity_fail;
-        }
-        if (memcmp_const(g_align[3], bufsize, 0x5a) == 0) {
-            printf("Re-read buffer was not updated\n");
-        } else if (memcmp(g_align[2], g_align[3], bufsize) == 0) {
-            if (flag_destructive) {
-                printf("Re-read of data matches what was read "
-                       "(write failure?)\n");
-            } else {
-                printf("Re-read of data matches what was read "
-                       "the second time\n");
-            }
-        } else if (flag_destructive &&
-                   (memcmp(g_align[curbuf], g_align[3], bufsize) == 0)) {
-            printf("Re-read of data matches what was written "
-                   "(read failure?)\n");
-        } else if (memcmp(g_ibuf[4], g_align[3], bufsize) == 0) {
-            printf("Re-read of data matches what was originally on disk\n");
-        } else {
-            printf("Re-read of data differs (floating data?)\n");
-            if (flag_destructive) {
-                show_diffs(g_align[curbuf], g_align[3], bufsize, "expected");
-                show_diffs(g_align[2], g_align[3], bufsize, "first read");
-            } else {
-                show_diffs(g_ibuf[4], g_align[3], bufsize, "first read");
-                show_diffs(g_align[2], g_align[3], bufsize, "second read");
-            }
-        }
-        CacheClearU();
-        if (flag_destructive) {
-            if (memcmp(g_align[curbuf], g_align[2], bufsize) == 0) {
-                printf("Initial read data now matches what was written "
-                       "(CPU cache or memory failure?)\n");
-            }
-        } else {
-            if (memcmp(g_ibuf[4], g_align[2], bufsize) == 0) {
-                printf("Initial read data now matches second read "
-                       "(CPU cache or memory failure?)\n");
-            }
-        }
-        rc = 1;
+        rc = integrity_miscompare(tio, pos, bufsize, g_align[curbuf],
+                                  g_ibuf[4], g_align[2]);
         goto integrity_fail;
     }
 
@@ -5397,7 +10106,7 @@ fail_cleanup:
 
         leftoffset += bytes_per_zone;
         if (is_user_abort()) {
-            printf("^C abort\n");
+            print_msg("^C abort\n");
             rc = 1;
             break;
         }
@@ -5411,6 +10120,240 @@ fail_cleanup:
     return (rc);
 }
 
+#define PIPE_IDLE    0  // Slot has no chunk
+#define PIPE_SAVE    1  // Reading original data
+#define PIPE_WRITE   2  // Writing test pattern
+#define PIPE_VERIFY  3  // Reading back data
+#define PIPE_RESTORE 4  // Writing original data back
+
+/*
+ * pipe_issue
+ * ----------
+ * Start an asynchronous read or write of a chunk for the pipeline
+ * integrity test.
+ */
+static void
+pipe_issue(struct IOExtTD *tio, UWORD iocmd, uint64_t pos, uint len,
+           uint8_t *buf)
+{
+    pos += g_devstart;
+    tio->iotd_Req.io_Command = iocmd_for_end(iocmd, pos + len);
+    tio->iotd_Req.io_Actual  = pos >> 32;
+    tio->iotd_Req.io_Offset  = (uint32_t) pos;
+    tio->iotd_Req.io_Length  = len;
+    tio->iotd_Req.io_Data    = buf;
+    tio->iotd_Req.io_Flags   = 0;
+    tio->iotd_Req.io_Error   = 0xa5;
+    SendIO((struct IORequest *) tio);
+}
+
+/*
+ * test_integrity_pipeline
+ * -----------------------
+ * This test checks the entire device sequentially, the same as the
+ * simple test, but keeps PIPE_DEPTH chunks in flight so that the drive
+ * is not left idle while the CPU compares data. Each chunk has its own
+ * I/O request, and steps through saving the original data, writing the
+ * pattern, reading it back, and restoring the original data. While one
+ * chunk is being written, the next is being read back, and the one
+ * before that compared. Each pass is one full check of the media.
+ *
+ * g_align[IBUF_PIPE + slot * 2] is the read back buffer for a slot, and
+ * g_align[IBUF_PIPE + slot * 2 + 1] holds its original data, unless -dd
+ * was specified. Miscompares are reported by integrity_miscompare(),
+ * exactly as with the simple test. As with the simple test, each slot
+ * alternates between the two patterns on every chunk it writes, and its
+ * read buffer is filled with 0xa5 before every read back, so a read
+ * which reports success without transferring data is always caught.
+ */
+static int
+test_integrity_pipeline(struct IOExtTD *tio, uint bufsize)
+{
+    static uint8_t   curbuf[PIPE_DEPTH];
+    struct IOExtTD  *ptio[PIPE_DEPTH];
+    struct MsgPort  *mp = tio->iotd_Req.io_Message.mn_ReplyPort;
+    struct EClockVal stime;
+    struct EClockVal etime;
+    uint64_t pos[PIPE_DEPTH];
+    uint8_t *wbuf[PIPE_DEPTH];
+    uint8_t *rbuf;
+    uint8_t *obuf;
+    uint64_t devstart;
+    uint64_t devend;
+    uint64_t devsize;
+    uint64_t next = 0;
+    uint64_t done = 0;
+    uint64_t ticks;
+    uint     stage[PIPE_DEPTH];
+    uint     busy = 0;
+    uint     stop = 0;
+    uint     slot;
+    uint     percent;
+    uint     last_percent = 0;
+    int      rc = 0;
+    int      rc2;
+
+    dev_range(&devstart, &devend);
+    devsize = devend - devstart;
+    if (devsize < bufsize) {
+        printf("Device is not large enough to test with block size %u\n",
+               bufsize);
+        return (1);
+    }
+
+    memset(ptio, 0, sizeof (ptio));
+    ptio[0] = tio;
+    for (slot = 1; slot < PIPE_DEPTH; slot++) {
+        ptio[slot] = (struct IOExtTD *) CreateExtIO(mp,
+                                                    sizeof (struct IOExtTD));
+        if (ptio[slot] == NULL) {
+            printf("Failed to create tio struct\n");
+            rc = 1;
+            goto pipe_fail;
+        }
+        if ((rc = open_device(ptio[slot])) != 0) {
+            printf("Open %s Unit %u: ", g_devname, g_unitno);
+            print_fail_nl(rc);
+            DeleteExtIO((struct IORequest *) ptio[slot]);
+            ptio[slot] = NULL;
+            rc = 1;
+            goto pipe_fail;
+        }
+    }
+
+    ReadEClock(&stime);
+    for (slot = 0; slot < PIPE_DEPTH; slot++)
+        stage[slot] = PIPE_IDLE;
+    slot = 0;
+    do {
+        rbuf = g_align[IBUF_PIPE + slot * 2];
+        obuf = g_align[IBUF_PIPE + slot * 2 + 1];
+
+        if (busy & BIT(slot)) {
+            /* Collect the slot's request and decide its next stage */
+            WaitIO((struct IORequest *) ptio[slot]);
+            busy &= ~BIT(slot);
+            rc2 = ptio[slot]->iotd_Req.io_Error;
+            if (rc2 != 0) {
+                printf("%s failed at %s\n",
+                       (stage[slot] == PIPE_WRITE) ? "write" :
+                       (stage[slot] == PIPE_RESTORE) ?
+                       "restore of original data" : "read",
+                       llu_sector_to_str(pos[slot]));
+            }
+            switch (stage[slot]) {
+                case PIPE_SAVE:
+                    if (rc2 != 0)
+                        stage[slot] = PIPE_IDLE;
+                    else if (flag_destructive)
+                        stage[slot] = PIPE_WRITE;
+                    else
+                        stage[slot] = PIPE_VERIFY;
+                    break;
+                case PIPE_WRITE:
+                    stage[slot] = (rc2 != 0) ? PIPE_RESTORE : PIPE_VERIFY;
+                    break;
+                case PIPE_VERIFY:
+                    if ((rc2 == 0) &&
+                        ((flag_destructive &&
+                          (memcmp(wbuf[slot], rbuf, bufsize) != 0)) ||
+                         (!flag_destructive &&
+                          (memcmp(obuf, rbuf, bufsize) != 0)))) {
+                        /*
+                         * Read data either mismatches the newly written
+                         * pattern (destructive mode) or mismatches the
+                         * previously read data (read-only mode).
+                         */
+                        rc2 = integrity_miscompare(ptio[slot], pos[slot],
+                                                   bufsize, wbuf[slot], obuf,
+                                                   rbuf);
+                    }
+                    if (rc2 == 0)
+                        done += bufsize;
+                    stage[slot] = PIPE_RESTORE;
+                    break;
+                case PIPE_RESTORE:
+                    stage[slot] = PIPE_IDLE;
+                    break;
+            }
+            if ((stage[slot] == PIPE_RESTORE) && (flag_destructive != 1))
+                stage[slot] = PIPE_IDLE;
+            if (rc2 != 0) {
+                if (rc == 0)
+                    rc = rc2;
+                stop = 1;
+            }
+        }
+
+        if ((stage[slot] == PIPE_IDLE) && !stop &&
+            (next + bufsize <= devsize)) {
+            /* Start the next chunk in this slot */
+            pos[slot] = next;
+            wbuf[slot] = g_align[(curbuf[slot] + slot) & 1];
+            curbuf[slot] ^= 1;
+            next += bufsize;
+            stage[slot] = (flag_destructive < 2) ? PIPE_SAVE : PIPE_WRITE;
+
+            percent = next * 1000 / devsize;
+            if (g_verbose && (percent / 10 != last_percent / 10)) {
+                printf("Sector %s (%u%% of media check #%u)\r",
+                       llu_sector_to_str(pos[slot]), percent / 10,
+                       checknum + 1);
+                fflush(stdout);
+            }
+            last_percent = percent;
+            if (is_user_abort()) {
+                print_msg("^C abort\n");
+                stage[slot] = PIPE_IDLE;
+                rc = 1;
+                stop = 1;
+            }
+        }
+
+        switch (stage[slot]) {
+            case PIPE_SAVE:
+                pipe_issue(ptio[slot], CMD_READ, pos[slot], bufsize, obuf);
+                break;
+            case PIPE_WRITE:
+                pipe_issue(ptio[slot], CMD_WRITE, pos[slot], bufsize,
+                           wbuf[slot]);
+                break;
+            case PIPE_VERIFY:
+                memset(rbuf, 0xa5, bufsize);
+                pipe_issue(ptio[slot], CMD_READ, pos[slot], bufsize, rbuf);
+                break;
+            case PIPE_RESTORE:
+                pipe_issue(ptio[slot], CMD_WRITE, pos[slot], bufsize, obuf);
+                break;
+        }
+        if (stage[slot] != PIPE_IDLE)
+            busy |= BIT(slot);
+        slot = (slot + 1) % PIPE_DEPTH;
+    } while (busy != 0);
+    ReadEClock(&etime);
+
+    ticks = diff_e_clock(&stime, &etime);
+    if (ticks == 0)
+        ticks = 1;
+    if (g_verbose)
+        printf("\n");
+    printf("Checked %s in %u.%02u sec: %u KB/sec\n",
+           bytes_to_human_str(done, 1), (uint) (ticks / g_e_freq),
+           (uint) (ticks % g_e_freq * 100 / g_e_freq),
+           calc_kb_per_sec(done, ticks));
+    if (!stop)
+        checknum++;
+
+pipe_fail:
+    for (slot = 1; slot < PIPE_DEPTH; slot++) {
+        if (ptio[slot] != NULL) {
+            close_device(ptio[slot]);
+            DeleteExtIO((struct IORequest *) ptio[slot]);
+        }
+    }
+    return (rc);
+}
+
 static int
 test_integrity(uint mode, uint pattern, uint32_t memtype, uint bufsize,
                uint align)
@@ -5459,9 +10402,15 @@ test_integrity(uint mode, uint pattern, uint32_t memtype, uint bufsize,
              *               every re-read.
              * g_ibuf[4] is original data buffer 1, unless -dd specified
              * g_ibuf[5] is original data buffer 2, unless -dd specified
+             * g_align[6] and up are read and original data buffers for
+             *               each -k pipeline slot (see IBUF_PIPE)
              */
             if (((bnum == 4) || (bnum == 5)) && (flag_destructive > 1))
                 continue;
+            if ((bnum >= IBUF_PIPE) &&
+                ((mode != 3) ||
+                 (((bnum - IBUF_PIPE) & 1) && (flag_destructive > 1))))
+                continue;
             g_ibuf[bnum] = AllocMemType(bufsize + align, memtypex);
             if (g_ibuf[bnum] == NULL) {
                 report_allocmem_fail(bufsize + align, memtypex);
@@ -5518,7 +10467,8 @@ test_integrity(uint mode, uint pattern, uint32_t memtype, uint bufsize,
             } else if (bnum == 1) {
                 for (cur = 0; cur < bufsize; cur++)
                     g_align[bnum][cur] = ~g_align[0][cur];
-            } else if (bnum == 2) {
+            } else if ((bnum == 2) ||
+                       ((bnum >= IBUF_PIPE) && !((bnum - IBUF_PIPE) & 1))) {
                 /* Pattern the receive buffer */
                 memset(g_align[bnum], 0xa5, bufsize);
             }
@@ -5539,6 +10489,9 @@ test_integrity(uint mode, uint pattern, uint32_t memtype, uint bufsize,
         case 2:  // -k butterfly
             rc = test_integrity_butterfly(tio, bufsize);
             break;
+        case 3:  // -k pipeline
+            rc = test_integrity_pipeline(tio, bufsize);
+            break;
     }
     g_turn_motor_off = 1;
 
@@ -5639,6 +10592,53 @@ get_cmd(const char *str, args_t *args)
     exit(RETURN_ERROR);
 }
 
+static void
+show_bench_modes(void)
+{
+    size_t pos;
+    printf("  Name        Args                 Description\n"
+           "  ----------- -------------------- --------------------------\n");
+    for (pos = 0; pos < ARRAY_SIZE(bench_modes); pos++) {
+        printf("  %-11s %-20s %s\n",
+               bench_modes[pos].alias,
+               bench_modes[pos].args ? bench_modes[pos].args : "",
+               bench_modes[pos].desc);
+    }
+}
+
+static uint32_t
+get_bench_mode(char *str)
+{
+    size_t pos;
+    char  *arg = strchr(str, '(');
+
+    if (arg != NULL) {
+        char *end;
+        *(arg++) = '\0';
+        if ((end = strchr(arg, ')')) != NULL)
+            *end = '\0';
+    }
+
+    for (pos = 0; pos < ARRAY_SIZE(bench_modes); pos++) {
+        if (strcasecmp(bench_modes[pos].alias, str) == 0) {
+            if ((arg != NULL) && (bench_modes[pos].args == NULL)) {
+                printf("No arguments for %s\n", str);
+                exit(RETURN_ERROR);
+            }
+            if ((bench_modes[pos].parse != NULL) &&
+                bench_modes[pos].parse(arg)) {
+                exit(RETURN_ERROR);
+            }
+            return (bench_modes[pos].mask);
+        }
+    }
+
+    printf("Invalid benchmark test \"%s\"\n", str);
+    printf("Use one of:\n");
+    show_bench_modes();
+    exit(RETURN_ERROR);
+}
+
 static void
 parse_tsize(const char *arg, uint *tsize, int *pos)
 {
@@ -5672,6 +10672,105 @@ parse_tsize(const char *arg, uint *tsize, int *pos)
     }
 }
 
+/*
+ * parse_digits
+ * ------------
+ * Parse the digits of a 64-bit number in decimal or hex (0x prefix),
+ * advancing *argp past them. Returns non-zero if there are no digits or
+ * the value does not fit in 64 bits.
+ */
+static int
+parse_digits(const char **argp, uint64_t *value)
+{
+    const char *arg = *argp;
+    uint        base = 10;
+    uint        digit;
+
+    if ((arg[0] == '0') && ((arg[1] == 'x') || (arg[1] == 'X'))) {
+        base = 16;
+        arg += 2;
+    }
+    if (!isxdigit((unsigned char) *arg))
+        return (1);
+    *value = 0;
+    for (; isxdigit((unsigned char) *arg); arg++) {
+        if (isdigit((unsigned char) *arg))
+            digit = *arg - '0';
+        else
+            digit = tolower((unsigned char) *arg) - 'a' + 10;
+        if (digit >= base)
+            break;
+        if (*value > (~0ULL - digit) / base)
+            return (1);  // Overflow
+        *value = *value * base + digit;
+    }
+    *argp = arg;
+    return (0);
+}
+
+/*
+ * parse_offset
+ * ------------
+ * Parse a 64-bit number such as a device byte offset, in decimal or hex
+ * (0x prefix), with an optional K, M, or G suffix which may be followed
+ * by B. Other trailing characters and values which do not fit in 64 bits
+ * are rejected.
+ */
+static int
+parse_offset(const char *arg, uint64_t *offset)
+{
+    uint64_t value;
+    uint     shift = 0;
+
+    if (parse_digits(&arg, &value))
+        return (1);
+    switch (*arg) {
+        case 'k':
+        case 'K':
+            shift = 10;
+            break;
+        case 'm':
+        case 'M':
+            shift = 20;
+            break;
+        case 'g':
+        case 'G':
+            shift = 30;
+            break;
+    }
+    if (shift != 0) {
+        arg++;
+        if ((*arg == 'b') || (*arg == 'B'))
+            arg++;
+        if ((value << shift) >> shift != value)
+            return (1);  // Overflow
+    }
+    if (*arg != '\0')
+        return (1);
+    *offset = value << shift;
+    return (0);
+}
+
+/*
+ * parse_count
+ * -----------
+ * Parse a count in decimal or hex (0x prefix), rejecting signs, trailing
+ * characters and values outside of the range min to max. A leading zero
+ * does not make the count octal.
+ */
+static int
+parse_count(const char *arg, uint *value, uint min, uint max)
+{
+    uint64_t count;
+
+    if (parse_digits(&arg, &count) || (*arg != '\0') ||
+        (count < min) || (count > max)) {
+        return (1);
+    }
+    *value = count;
+    return (0);
+}
+
 int
 main(int argc, char *argv[])
 {
@@ -5752,12 +10851,26 @@ main(int argc, char *argv[])
                     case 'd':
                         flag_destructive++;
                         break;
+                    case 'e':
+                        if (flag_benchmark == 0)
+                            flag_benchmark++;
+                        if (++arg < argc) {
+                            bench_mask |= get_bench_mode(argv[arg]);
+                        } else {
+                            printf("-%s requires an argument\n", ptr);
+                            show_bench_modes();
+                            exit(RETURN_ERROR);
+                        }
+                        break;
                     case 'g':
                         flag_geometry++;
                         break;
                     case 'h':
                         usage();
                         exit(RETURN_OK);
+                    case 'H':
+                        flag_lat_hist++;
+                        break;
                     case 'i':
                         if (flag_integrity++ > 0)
                             break;
@@ -5796,6 +10909,9 @@ main(int argc, char *argv[])
                                 test_mode = 2;
                             } else if (strncmp(argv[arg], "simple", len) == 0) {
                                 test_mode = 1;
+                            } else if (strncmp(argv[arg], "pipeline",
+                                               len) == 0) {
+                                test_mode = 3;
                             } else {
                                 printf("Unknown integrity test mode %s\n",
                                        argv[arg]);
@@ -5803,7 +10919,8 @@ main(int argc, char *argv[])
                             }
                         } else {
                             printf("-%s requires an argument\n", ptr);
-                            printf("    One of: simple or butterfly\n");
+                            printf("    One of: simple, butterfly, or "
+                                   "pipeline\n");
                             exit(RETURN_ERROR);
                         }
                         break;
@@ -5869,15 +10986,115 @@ main(int argc, char *argv[])
                             exit(RETURN_ERROR);
                         }
                         break;
+                    case 'O':
+                        if (++arg >= argc) {
+                            printf("-%s requires an argument: json or csv\n",
+                                   ptr);
+                            exit(RETURN_ERROR);
+                        }
+                        if (strcasecmp(argv[arg], "json") == 0) {
+                            g_output = OUTPUT_JSON;
+                        } else if (strcasecmp(argv[arg], "csv") == 0) {
+                            g_output = OUTPUT_CSV;
+                        } else {
+                            printf("Invalid output format %s; "
+                                   "use json or csv\n", argv[arg]);
+                            exit(RETURN_ERROR);
+                        }
+                        break;
                     case 'o':
                         flag_openclose++;
                         break;
+                    case 'r':
+                        if (++arg >= argc) {
+                            printf("-%s requires an argument: "
+                                   "<ci%%>[,<max>]\n", ptr);
+                            exit(RETURN_ERROR);
+                        }
+                        if ((sscanf(argv[arg], "%u%n", &repeat_ci,
+                                    &pos) != 1) || (repeat_ci == 0) ||
+                            ((argv[arg][pos] != '\0') &&
+                             (argv[arg][pos] != ',')) ||
+                            ((argv[arg][pos] == ',') &&
+                             parse_count(argv[arg] + pos + 1, &repeat_max,
+                                         2, ~0U))) {
+                            printf("Invalid repeat argument %s\n",
+                                   argv[arg]);
+                            exit(RETURN_ERROR);
+                        }
+                        break;
+                    case 'R':
+                        if (++arg >= argc) {
+                            printf("-%s requires a baseline file name\n",
+                                   ptr);
+                            exit(RETURN_ERROR);
+                        } else {
+                            char *tol = strrchr(argv[arg], ',');
+                            if (tol != NULL) {
+                                *(tol++) = '\0';
+                                if (sscanf(tol, "%u",
+                                           &baseline_tolerance) != 1) {
+                                    printf("Invalid tolerance %s\n", tol);
+                                    exit(RETURN_ERROR);
+                                }
+                            }
+                            baseline_cmp_file = argv[arg];
+                        }
+                        break;
+                    case 's':
+                        if (++arg >= argc) {
+                            printf("-%s requires an argument: <offset>\n",
+                                   ptr);
+                            exit(RETURN_ERROR);
+                        }
+                        if (parse_offset(argv[arg], &bench_offset)) {
+                            printf("Invalid offset %s\n", argv[arg]);
+                            exit(RETURN_ERROR);
+                        }
+                        if (bench_offset & 511) {
+                            printf("Offset %s is not a multiple of 512 "
+                                   "bytes\n", argv[arg]);
+                            exit(RETURN_ERROR);
+                        }
+                        break;
+                    case 'S':
+                        if (++arg >= argc) {
+                            printf("-%s requires a baseline file name\n",
+                                   ptr);
+                            exit(RETURN_ERROR);
+                        }
+                        baseline_save_file = argv[arg];
+                        break;
+                    case 'n':
+                        flag_nocache++;
+                        break;
                     case 'p':
                         flag_probe++;
                         break;
                     case 't':
                         flag_testpackets++;
                         break;
+                    case 'T':
+                        if (++arg >= argc) {
+                            printf("-%s requires an argument: "
+                                   "<sec>[,<warmup>]\n", ptr);
+                            exit(RETURN_ERROR);
+                        }
+                        if ((sscanf(argv[arg], "%u%n", &bench_duration,
+                                    &pos) != 1) || (bench_duration == 0) ||
+                            ((argv[arg][pos] != '\0') &&
+                             (argv[arg][pos] != ',')) ||
+                            ((argv[arg][pos] == ',') &&
+                             parse_count(argv[arg] + pos + 1, &bench_warmup,
+                                         0, ~0U))) {
+                            printf("Invalid duration argument %s\n",
+                                   argv[arg]);
+                            exit(RETURN_ERROR);
+                        }
+                        break;
+                    case 'u':
+                        flag_cpu++;
+                        break;
                     case 'v':
                         g_verbose++;
                         break;
@@ -5966,6 +11183,8 @@ got_unit:
             goto allocmem_fail;
         }
     }
+    if (flag_cpu && flag_benchmark && cpu_idle_start())
+        goto allocmem_fail;
 
     for (loop = 0; loop < loops; loop++) {
         uint stop_on_error = (loop != 0) || (loops == 1);
@@ -5977,9 +11196,13 @@ got_unit:
             else
                 printf("\n");
         }
-        if (flag_benchmark &&
-            drive_benchmark(flag_destructive, memtype))
+        if (flag_benchmark && (bench_mask & BENCH_MEMTYPES)) {
+            if (drive_memtype_matrix(flag_destructive, memtype))
+                break;
+        } else if (flag_benchmark &&
+                   drive_benchmark(flag_destructive, memtype)) {
             break;
+        }
 
         if (flag_openclose) {
             if ((rc = open_device(&tio)) != 0) {
@@ -6025,6 +11248,7 @@ got_unit:
         close_device(&tio);
 
 allocmem_fail:
+    cpu_idle_stop();
     for (bnum = 0; bnum < ARRAY_SIZE(g_tbuf); bnum++)
         if (g_tbuf[bnum] != NULL)
             FreeMemType(g_tbuf[bnum], BUFSIZE);
@@ -6039,8 +11263,20 @@ allocmem_fail:
         else
             printf("%u passes completed successfully\n", loops);
     }
-    if (loop < loops)
+    if (loop < loops) {
+        /* Don't save or compare results of a failed or aborted run */
         exit(RETURN_ERROR);
+    }
+    if ((baseline_save_file != NULL) && baseline_save(baseline_save_file))
+        exit(RETURN_ERROR);
+    if (baseline_cmp_file != NULL) {
+        int regressions = baseline_compare(baseline_cmp_file,
+                                           baseline_tolerance);
+        if (regressions < 0)
+            exit(RETURN_ERROR);
+        if (regressions > 0)
+            exit(RETURN_WARN);
+    }
 
     exit(RETURN_OK);
 }